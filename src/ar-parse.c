@@ -25,7 +25,10 @@
 #include <config.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,86 +42,526 @@
 #include <dpkg/error.h>
 #include <dpkg/buffer.h>
 #include <dpkg/fdio.h>
+#include <dpkg/path.h>
 
 #include "debsig.h"
 
-/* This function takes a member name as an argument. It then goes through
- * the archive trying to find it. If it does, it returns the size of the
- * member's data, and leaves the deb_fd file pointer at the start of that
- * data. Yes, we may have a zero length member in here somewhere, but
- * nothing important is going to be zero length anyway, so we treat it as
- * "non-existant".  */
-off_t
-findMember(struct dpkg_ar *deb, const char *name)
+static ssize_t
+ar_pread(int fd, void *buf, size_t len, off_t offset)
+{
+    char *ptr = buf;
+    size_t total = 0;
+
+    while (total < len) {
+	ssize_t r = pread(fd, ptr + total, len - total, offset + total);
+
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r < 0)
+	    return r;
+	if (r == 0)
+	    break;
+	total += r;
+    }
+
+    return total;
+}
+
+/* Read from the archive at a given offset, out of its mapping if it has
+ * one. */
+static ssize_t
+ar_read_at(struct deb_archive *deb, void *buf, size_t len, off_t offset)
+{
+    if (deb->map == NULL)
+	return ar_pread(deb->ar->fd, buf, len, offset);
+
+    if (offset < 0 || (uintmax_t)offset >= deb->map_len)
+	return 0;
+    if (len > deb->map_len - offset)
+	len = deb->map_len - offset;
+    memcpy(buf, deb->map + offset, len);
+
+    return len;
+}
+
+/* Map regular files in memory, so that members can be handed out as slices
+ * of the mapping, read straight from the page cache. Anything else, or a
+ * failure to map, is read with pread() instead. Accessing a mapping past
+ * the end of a file truncated meanwhile raises SIGBUS, so only files we
+ * opened by name ourselves get mapped, never descriptors handed to us by
+ * the program or a daemon client, which could be shrinking them on
+ * purpose. */
+static void
+ar_map(struct deb_archive *deb)
+{
+    struct stat st;
+    void *map;
+
+    if (fstat(deb->ar->fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size == 0 || (uintmax_t)st.st_size > SIZE_MAX)
+	return;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, deb->ar->fd, 0);
+    if (map == MAP_FAILED) {
+	ds_printf(DS_LEV_DEBUG, "ar_map: cannot map %s: %s", deb->ar->name,
+	          strerror(errno));
+	return;
+    }
+    /* Members mostly get hashed from start to end. */
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    deb->map = map;
+    deb->map_len = st.st_size;
+}
+
+static void
+ar_toc_append(struct deb_archive *deb, const struct dpkg_ar_hdr *arh,
+              off_t offset, off_t size)
+{
+    struct ar_member *mem;
+
+    if (deb->nmembers == deb->members_size) {
+	deb->members_size = deb->members_size ? deb->members_size * 2 : 8;
+	deb->members = m_realloc(deb->members,
+	                         deb->members_size * sizeof(*deb->members));
+    }
+
+    mem = &deb->members[deb->nmembers++];
+    memcpy(mem->name, arh->ar_name, sizeof(arh->ar_name));
+    mem->name[sizeof(arh->ar_name)] = '\0';
+    mem->offset = offset;
+    mem->size = size;
+    mem->data = NULL;
+}
+
+/* Walk the archive headers once, recording the name, data offset and
+ * size of every member, so that later lookups do not need to touch the
+ * file at all. A bad magic leaves the table empty, and we will fail in
+ * main() when the required members cannot be found. */
+static void
+ar_toc_load(struct deb_archive *deb)
 {
-    struct dpkg_error err;
     char magic[SARMAG + 1];
     struct dpkg_ar_hdr arh;
-    off_t mem_len;
+    off_t offset, mem_len;
     ssize_t r;
-    size_t len = strlen(name);
 
-    if (len > sizeof(arh.ar_name)) {
-	ds_printf(DS_LEV_DEBUG, "findMember: '%s' is too long to be an archive member name",
-		  name);
-	return 0;
+    r = ar_read_at(deb, magic, SARMAG, 0);
+    if (r < 0)
+	ohshite("ar_toc_load: failure to read package");
+    if (r != SARMAG)
+	ohshit("ar_toc_load: unexpected end of package");
+
+    magic[SARMAG] = '\0';
+
+    if (strcmp(magic, ARMAG) != 0) {
+	ds_printf(DS_LEV_DEBUG, "ar_toc_load: archive has bad magic");
+	return;
     }
 
-    /* This shouldn't happen, but... */
-    if (deb->fd < 0)
-	ohshit("findMember: called while deb_fd < 0");
+    for (offset = SARMAG; ; offset += mem_len + (mem_len & 1)) {
+	r = ar_read_at(deb, &arh, sizeof(arh), offset);
+	if (r == 0)
+	    break;
+	if (r < 0)
+	    ohshite("ar_toc_load: error while parsing archive header");
+	if (r != sizeof(arh))
+	    ohshit("ar_toc_load: unexpected end of package");
 
-    if (lseek(deb->fd, 0, SEEK_SET) < 0)
-	ohshit("findMember: cannot rewind package");
+	if (dpkg_ar_member_is_illegal(&arh))
+	    ohshit("ar_toc_load: archive appears to be corrupt, fmag incorrect");
+
+	/*
+	 * The ar_name field is padded with spaces to get the full length.
+	 * The actual name may also be suffixed with '/' (dpkg-deb creates
+	 * .deb's without the trailing '/' in the member names, but binutils
+	 * ar does, so we try to be compatible, like dpkg does). We don't
+	 * support the "extended naming" scheme that binutils does.
+	 */
+	dpkg_ar_normalize_name(&arh);
+	mem_len = dpkg_ar_member_get_size(deb->ar, &arh);
+	offset += sizeof(arh);
+
+	ds_printf(DS_LEV_DEBUG, "ar_toc_load: member '%.*s' at %jd, %jd bytes",
+	          (int)sizeof(arh.ar_name), arh.ar_name,
+	          (intmax_t)offset, (intmax_t)mem_len);
 
-    r = fd_read(deb->fd, magic, SARMAG);
+	ar_toc_append(deb, &arh, offset, mem_len);
+    }
+}
+
+/* Read from a stream, copying what got read to the spool file. */
+static ssize_t
+ar_stream_read(struct deb_archive *deb, int spool_fd, void *buf, size_t len)
+{
+    ssize_t r;
+
+    r = fd_read(deb->ar->fd, buf, len);
+    if (r > 0 && fd_write(spool_fd, buf, r) < 0)
+	ohshite("ar_stream_load: cannot write to temp file");
+
+    return r;
+}
+
+/* Read the data of the current member off the stream, along with its
+ * padding, hashing it if digest is not NULL. */
+static void
+ar_stream_member(struct deb_archive *deb, int spool_fd,
+                 const struct ar_member *mem, struct deb_digest *digest)
+{
+    char buf[8192];
+    off_t len = mem->size + (mem->size & 1);
+    off_t done = 0;
+    ssize_t r;
+
+    while (done < len) {
+	size_t chunk = sizeof(buf);
+
+	if ((off_t)chunk > len - done)
+	    chunk = len - done;
+	r = ar_stream_read(deb, spool_fd, buf, chunk);
+	if (r < 0)
+	    ohshite("ar_stream_load: cannot read member '%s'", mem->name);
+	if ((size_t)r != chunk)
+	    ohshit("ar_stream_load: unexpected end of package");
+	if (digest && done < mem->size)
+	    deb_digest_write(digest, buf,
+	                     (off_t)chunk > mem->size - done ?
+	                     (size_t)(mem->size - done) : chunk);
+	done += chunk;
+    }
+}
+
+/* Read the archive from start to end in a single pass, for streams that
+ * cannot be seeked. The leading members not starting with '_' are the
+ * signed payload, which dpkg requires to come in order, so they get
+ * hashed right away, with every algorithm we support, as we will only know
+ * which ones the signatures use after going past them. Everything read
+ * also gets copied to an unlinked temporary file, which then stands for
+ * the archive, so that its members can still be read back, when gpg needs
+ * to check a signature or the payload is not in the usual order. */
+static void
+ar_stream_load(struct deb_archive *deb)
+{
+    char magic[SARMAG + 1];
+    struct dpkg_ar_hdr arh;
+    off_t offset, mem_len;
+    char *tmp_deb;
+    int spool_fd;
+    ssize_t r;
+
+    deb->stream = true;
+
+    tmp_deb = path_make_temp_template("debsig-deb");
+    spool_fd = mkstemp(tmp_deb);
+    if (spool_fd < 0)
+	ohshite("ar_stream_load: cannot create temp file %s", tmp_deb);
+    unlink(tmp_deb);
+    free(tmp_deb);
+
+    r = ar_stream_read(deb, spool_fd, magic, SARMAG);
     if (r < 0)
-	ohshite("findMember: failure to read package");
+	ohshite("ar_stream_load: failure to read package");
     if (r != SARMAG)
-	ohshit("findMember: unexpected end of package");
+	ohshit("ar_stream_load: unexpected end of package");
 
     magic[SARMAG] = '\0';
 
-    /* We will fail in main() with this one */
     if (strcmp(magic, ARMAG) != 0) {
-	ds_printf(DS_LEV_DEBUG, "findMember: archive has bad magic");
-	return 0;
+	ds_printf(DS_LEV_DEBUG, "ar_stream_load: archive has bad magic");
+	close(spool_fd);
+	return;
     }
 
-    for (;;) {
-	r = fd_read(deb->fd, &arh, sizeof(arh));
+    for (offset = SARMAG; ; offset += mem_len + (mem_len & 1)) {
+	struct ar_member *mem;
+	struct deb_digest *digest = NULL;
+
+	r = ar_stream_read(deb, spool_fd, &arh, sizeof(arh));
 	if (r == 0)
-	    return 0;
+	    break;
 	if (r < 0)
-	    ohshite("findMember: error while parsing archive header");
+	    ohshite("ar_stream_load: error while parsing archive header");
 	if (r != sizeof(arh))
-	    ohshit("findMember: unexpected end of package");
+	    ohshit("ar_stream_load: unexpected end of package");
 
 	if (dpkg_ar_member_is_illegal(&arh))
-	    ohshit("findMember: archive appears to be corrupt, fmag incorrect");
+	    ohshit("ar_stream_load: archive appears to be corrupt, fmag incorrect");
 
 	dpkg_ar_normalize_name(&arh);
-	mem_len = dpkg_ar_member_get_size(deb, &arh);
+	mem_len = dpkg_ar_member_get_size(deb->ar, &arh);
+	offset += sizeof(arh);
 
-	/*
-	 * If all looks well, then we return the length of the member, and
-	 * leave the file pointer where it is (at the start of the data).
-	 * The logic here is based on the ar spec. The ar_name field is
-	 * padded with spaces to get the full length. The actual name may
-	 * also be suffixed with '/' (dpkg-deb creates .deb's without the
-	 * trailing '/' in the member names, but binutils ar does, so we
-	 * try to be compatible, like dpkg does). We don't support the
-	 * "extended naming" scheme that binutils does.
-	 */
-	if (strncmp(arh.ar_name, name, len) == 0 &&
-	    strnlen(arh.ar_name, sizeof(arh.ar_name)) == len)
-	    return mem_len;
+	ds_printf(DS_LEV_DEBUG, "ar_stream_load: member '%.*s' at %jd, %jd bytes",
+	          (int)sizeof(arh.ar_name), arh.ar_name,
+	          (intmax_t)offset, (intmax_t)mem_len);
+
+	ar_toc_append(deb, &arh, offset, mem_len);
+	mem = &deb->members[deb->nmembers - 1];
+
+	if (mem->name[0] != '_' && deb->nhashed < DEB_SIGNED_MEMBERS) {
+	    if (deb->digest == NULL)
+		deb->digest = deb_digest_new();
+	    digest = deb->digest;
+	    deb->hashed[deb->nhashed++] = deb->nmembers - 1;
+	}
+
+	ar_stream_member(deb, spool_fd, mem, digest);
+    }
+
+    /* Keep the descriptor number, so that standard input does not get
+     * freed for the next descriptor we open. */
+    if (dup2(spool_fd, deb->ar->fd) < 0)
+	ohshite("ar_stream_load: cannot replace %s", deb->ar->name);
+    close(spool_fd);
+
+    /* Being ours, the copy can always be mapped. */
+    ar_map(deb);
+}
 
-	/* Skip to the start of the next member, and try again. */
-	if (fd_skip(deb->fd, mem_len + (mem_len & 1), &err) < 0)
-	    ohshit("findMember: error while skipping member data: %s", err.str);
+/* Load the table of contents, or the whole archive if it is a stream.
+ * The archive only gets mapped if map is true. */
+static void
+ar_load(struct deb_archive *deb, bool map)
+{
+    if (lseek(deb->ar->fd, 0, SEEK_CUR) < 0 && errno == ESPIPE) {
+	ar_stream_load(deb);
+    } else {
+	if (map)
+	    ar_map(deb);
+	ar_toc_load(deb);
+    }
+}
+
+struct deb_archive *
+deb_archive_open(const char *filename)
+{
+    struct deb_archive *deb;
+
+    deb = m_malloc(sizeof(*deb));
+    memset(deb, 0, sizeof(*deb));
+    deb->ar = dpkg_ar_open(filename);
+
+    /* Standard input is not ours either. */
+    ar_load(deb, strcmp(filename, "-") != 0);
+
+    return deb;
+}
+
+/* Same as deb_archive_open(), but on an already open file descriptor,
+ * which gets closed together with the archive. */
+struct deb_archive *
+deb_archive_fdopen(const char *filename, int fd)
+{
+    struct deb_archive *deb;
+
+    deb = m_malloc(sizeof(*deb));
+    memset(deb, 0, sizeof(*deb));
+    deb->ar = dpkg_ar_fdopen(filename, fd);
+
+    ar_load(deb, false);
+
+    return deb;
+}
+
+void
+deb_archive_close(struct deb_archive *deb)
+{
+    int i;
+
+    while (deb->results) {
+	struct sig_result *res = deb->results;
+
+	deb->results = res->next;
+	free(res->file);
+	free(res);
+    }
+    deb_digest_free(deb->digest);
+    deb_sigs_free(deb);
+
+    if (deb->map)
+	munmap((void *)deb->map, deb->map_len);
+    dpkg_ar_close(deb->ar);
+    for (i = 0; i < deb->nmembers; i++)
+	free(deb->members[i].data);
+    free(deb->members);
+    free(deb);
+}
+
+/* Whether the payload hashed off a stream is the one that got signed. */
+bool
+deb_archive_stream_hashed(const struct deb_archive *deb)
+{
+    int i;
+
+    if (deb->nhashed != DEB_SIGNED_MEMBERS)
+	return false;
+    for (i = 0; i < DEB_SIGNED_MEMBERS; i++)
+	if (deb->signed_members[i] != &deb->members[deb->hashed[i]])
+	    return false;
+
+    return true;
+}
+
+/* This function takes a member name as an argument, and looks it up in
+ * the archive table of contents. If it is found, it returns the member
+ * entry, which holds the offset and size of the member's data. Yes, we
+ * may have a zero length member in here somewhere, but nothing important
+ * is going to be zero length anyway, so we treat it as "non-existant". */
+const struct ar_member *
+findMember(struct deb_archive *deb, const char *name)
+{
+    size_t len = strlen(name);
+    int i;
+
+    if (len >= sizeof(deb->members[0].name)) {
+	ds_printf(DS_LEV_DEBUG, "findMember: '%s' is too long to be an archive member name",
+		  name);
+	return NULL;
+    }
+
+    for (i = 0; i < deb->nmembers; i++) {
+	const struct ar_member *mem = &deb->members[i];
+
+	if (strcmp(mem->name, name) != 0)
+	    continue;
+	if (mem->size == 0)
+	    return NULL;
+	return mem;
     }
 
     /* well, nothing found, so let's pass on the bad news */
+    return NULL;
+}
+
+/* Pass the data of an archive member to func, as a single slice if the
+ * archive is mapped, or otherwise in chunks read from its known offset, so
+ * that the archive file position is never relied upon. */
+off_t
+readMemberData(struct deb_archive *deb, const struct ar_member *mem,
+               member_data_func *func, void *data, struct dpkg_error *err)
+{
+    char buf[8192];
+    off_t done = 0;
+
+    if (mem->data) {
+	if (func(mem->data, mem->size, data, err) < 0)
+	    return -1;
+	return mem->size;
+    }
+    if (deb->map) {
+	if ((uintmax_t)mem->offset + mem->size > deb->map_len)
+	    return dpkg_put_error(err, "unexpected end of member '%s'",
+	                          mem->name);
+	if (func(deb->map + mem->offset, mem->size, data, err) < 0)
+	    return -1;
+	return mem->size;
+    }
+
+    while (done < mem->size) {
+	size_t len = sizeof(buf);
+	ssize_t r;
+
+	if ((off_t)len > mem->size - done)
+	    len = mem->size - done;
+
+	r = ar_pread(deb->ar->fd, buf, len, mem->offset + done);
+	if (r < 0)
+	    return dpkg_put_errno(err, "cannot read member '%s'", mem->name);
+	if (r == 0)
+	    return dpkg_put_error(err, "unexpected end of member '%s'",
+	                          mem->name);
+
+	if (func(buf, r, data, err) < 0)
+	    return -1;
+
+	done += r;
+    }
+
+    return done;
+}
+
+static int
+member_write_fd(const void *buf, size_t len, void *data,
+                struct dpkg_error *err)
+{
+    int fd = *(int *)data;
+
+    if (fd_write(fd, buf, len) < 0)
+	return dpkg_put_errno(err, "cannot write member data");
+
     return 0;
 }
+
+/* Copy the data of an archive member to fd. */
+off_t
+copyMember(struct deb_archive *deb, const struct ar_member *mem, int fd,
+           struct dpkg_error *err)
+{
+    return readMemberData(deb, mem, member_write_fd, &fd, err);
+}
+
+/* Get the data of an archive member, as a slice of the archive mapping,
+ * or otherwise loaded once into memory. It stays valid until the archive
+ * gets closed. */
+const void *
+readMember(struct deb_archive *deb, const struct ar_member *mem,
+           struct dpkg_error *err)
+{
+    struct ar_member *m = &deb->members[mem - deb->members];
+    void *buf;
+    ssize_t r;
+
+    if (mem->data)
+	return mem->data;
+    if (deb->map) {
+	if ((uintmax_t)mem->offset + mem->size > deb->map_len) {
+	    dpkg_put_error(err, "unexpected end of member '%s'", mem->name);
+	    return NULL;
+	}
+	return deb->map + mem->offset;
+    }
+
+    buf = m_malloc(mem->size);
+    r = ar_pread(deb->ar->fd, buf, mem->size, mem->offset);
+    if (r < 0 || r != mem->size) {
+	if (r < 0)
+	    dpkg_put_errno(err, "cannot read member '%s'", mem->name);
+	else
+	    dpkg_put_error(err, "unexpected end of member '%s'", mem->name);
+	free(buf);
+	return NULL;
+    }
+    m->data = buf;
+
+    return buf;
+}
+
+/* Pass the signed payload (the concatenation of the debian-binary,
+ * control and data members) in chunks to func. */
+off_t
+readSignedData(struct deb_archive *deb, member_data_func *func, void *data,
+               struct dpkg_error *err)
+{
+    off_t len, total = 0;
+    int i;
+
+    for (i = 0; i < DEB_SIGNED_MEMBERS; i++) {
+	if (deb->signed_members[i] == NULL)
+	    return dpkg_put_error(err, "missing signed archive member");
+
+	len = readMemberData(deb, deb->signed_members[i], func, data, err);
+	if (len < 0)
+	    return len;
+	total += len;
+    }
+
+    return total;
+}
+
+/* Copy the signed payload to fd. */
+off_t
+copySignedData(struct deb_archive *deb, int fd, struct dpkg_error *err)
+{
+    return readSignedData(deb, member_write_fd, &fd, err);
+}
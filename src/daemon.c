@@ -0,0 +1,425 @@
+/*
+ * debsig-verify - Debian package signature verification tool
+ *
+ * Copyright © 2026 Guillem Jover <guillem@debian.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * resident verification daemon, and its client side, over a Unix socket
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <dpkg/dpkg.h>
+#include <dpkg/fdio.h>
+#include <dpkg/subproc.h>
+
+#include "debsig.h"
+
+#define DS_REQUEST_MAGIC 0x64737631 /* "dsv1" */
+
+/* How long a client gets to send its request, and to take the reply, in
+ * seconds, so that a stuck client cannot hold a worker forever. */
+#define DS_REQUEST_TIMEOUT 10
+
+/* How long a client waits for the verification done by the daemon, in
+ * seconds, before doing it by itself. */
+#define DS_REPLY_TIMEOUT 120
+
+/* A request carries the package and the client stdout as file descriptors,
+ * so that the daemon reads the package with the permissions of the client,
+ * and its messages end up where the client would have printed them. */
+struct ds_request {
+    uint32_t magic;
+    int32_t debug_level;
+    int32_t list_only;
+    char force_file[NAME_MAX + 1];
+    char filename[PATH_MAX];
+};
+
+struct ds_reply {
+    uint32_t magic;
+    int32_t status;
+};
+
+static volatile sig_atomic_t daemon_quit;
+
+static void
+daemon_signal(int signo)
+{
+    daemon_quit = 1;
+}
+
+static int
+socket_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+static int
+daemonRecv(int sock, struct ds_request *req, int *deb_fd, int *out_fd)
+{
+    union {
+	char buf[CMSG_SPACE(2 * sizeof(int))];
+	struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t r;
+
+    *deb_fd = *out_fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+	r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (r < 0 && errno == EINTR);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	int fds[2];
+
+	if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+	    continue;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	*deb_fd = fds[0];
+	*out_fd = fds[1];
+    }
+
+    if (r != sizeof(*req) || req->magic != DS_REQUEST_MAGIC ||
+        *deb_fd < 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+	if (*deb_fd >= 0)
+	    close(*deb_fd);
+	if (*out_fd >= 0)
+	    close(*out_fd);
+	return -1;
+    }
+
+    req->force_file[sizeof(req->force_file) - 1] = '\0';
+    req->filename[sizeof(req->filename) - 1] = '\0';
+
+    return 0;
+}
+
+static void
+daemonHandle(struct debsig_ctx *ctx, int sock)
+{
+    struct ds_request req;
+    struct ds_reply reply;
+    struct debsig_result res;
+    struct verify_opts opts;
+    struct timeval tv;
+    int deb_fd, out_fd, saved_fd, saved_level;
+
+    tv.tv_sec = DS_REQUEST_TIMEOUT;
+    tv.tv_usec = 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+	ds_printf(DS_LEV_DEBUG, "daemonHandle: cannot set timeouts: %s",
+	          strerror(errno));
+	return;
+    }
+
+    if (daemonRecv(sock, &req, &deb_fd, &out_fd) < 0) {
+	ds_printf(DS_LEV_DEBUG, "daemonHandle: ignoring bogus request");
+	return;
+    }
+
+    reply.magic = DS_REQUEST_MAGIC;
+
+    /* Print the messages for this request to the client. Failing to do so
+     * only fails this request. */
+    fflush(stdout);
+    saved_fd = dup(STDOUT_FILENO);
+    if (saved_fd < 0 || dup2(out_fd, STDOUT_FILENO) < 0) {
+	ds_printf(DS_LEV_ERR, "cannot redirect output for %s: %s",
+	          req.filename, strerror(errno));
+	if (saved_fd >= 0)
+	    close(saved_fd);
+	close(out_fd);
+	close(deb_fd);
+	reply.status = DS_FAIL_INTERNAL;
+	goto reply;
+    }
+    close(out_fd);
+    saved_level = ds_debug_level;
+    ds_debug_level = ctx->log_level = req.debug_level;
+
+    opts.list_only = req.list_only;
+    opts.force_file = req.force_file[0] ? req.force_file : NULL;
+
+    memset(&res, 0, sizeof(res));
+    reply.status = verifyPackage(ctx, req.filename, deb_fd, &opts, &res);
+    if (res.error)
+	ds_printf(DS_LEV_ERR, "%s", res.error);
+    debsig_result_destroy(&res);
+
+    fflush(stdout);
+    m_dup2(saved_fd, STDOUT_FILENO);
+    close(saved_fd);
+    ds_debug_level = saved_level;
+
+reply:
+    if (fd_write(sock, &reply, sizeof(reply)) < 0)
+	ds_printf(DS_LEV_DEBUG, "daemonHandle: cannot reply for %s: %s",
+	          req.filename, strerror(errno));
+}
+
+static void
+daemonServe(struct debsig_ctx *ctx, int listen_fd)
+{
+    while (!daemon_quit) {
+	int sock;
+
+	sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    ohshite("cannot accept connection");
+	}
+
+	daemonHandle(ctx, sock);
+	close(sock);
+    }
+}
+
+/* Serve verification requests until told to stop by SIGTERM or SIGINT.
+ * The policies and keyrings loaded into the context while serving stay
+ * around for the next requests. */
+int
+daemonRun(struct debsig_ctx *ctx, const char *socket_path, int jobs)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct stat st;
+    sigset_t mask, oldmask;
+    pid_t *pids;
+    int listen_fd, i;
+
+    if (socket_addr(&addr, socket_path) < 0)
+	ohshite("invalid socket path '%s'", socket_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+	ohshite("cannot create socket");
+    /* Replace any stale socket left behind by a previous instance, but
+     * nothing else that might be there. */
+    if (lstat(socket_path, &st) == 0) {
+	if (!S_ISSOCK(st.st_mode))
+	    ohshit("'%s' exists and is not a socket", socket_path);
+	if (unlink(socket_path) < 0)
+	    ohshite("cannot remove old socket '%s'", socket_path);
+    } else if (errno != ENOENT) {
+	ohshite("cannot stat '%s'", socket_path);
+    }
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	ohshite("cannot bind socket to '%s'", socket_path);
+    /* Only the owner gets to connect, which cannot happen before listen(),
+     * so that there is no window with the default permissions. */
+    if (chmod(socket_path, 0600) < 0)
+	ohshite("cannot set permissions of socket '%s'", socket_path);
+    if (listen(listen_fd, SOMAXCONN) < 0)
+	ohshite("cannot listen on socket '%s'", socket_path);
+
+    /* No SA_RESTART, so that we get out of accept() to quit. */
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    /* A client going away must not take us down with it. */
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    ds_printf(DS_LEV_VER, "Serving requests on %s", socket_path);
+
+    if (jobs <= 1) {
+	daemonServe(ctx, listen_fd);
+    } else {
+	/* The workers all accept on the same socket, and keep their own
+	 * caches. */
+	fflush(stdout);
+	pids = m_malloc(jobs * sizeof(*pids));
+	for (i = 0; i < jobs; i++) {
+	    pids[i] = subproc_fork();
+	    if (pids[i] == 0) {
+		daemonServe(ctx, listen_fd);
+		gpg_tmpdir_remove(ctx);
+		exit(0);
+	    }
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	while (!daemon_quit)
+	    sigsuspend(&oldmask);
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+	for (i = 0; i < jobs; i++)
+	    kill(pids[i], SIGTERM);
+	for (i = 0; i < jobs; i++)
+	    subproc_reap(pids[i], "daemon worker", SUBPROC_NOCHECK);
+	free(pids);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    return 0;
+}
+
+/* Ask the daemon to verify a package. Returns its exit class, or -1 if
+ * the daemon could not be reached, so that the caller can do it itself. */
+int
+daemonVerify(const char *socket_path, const char *filename,
+             const struct verify_opts *opts)
+{
+    union {
+	char buf[CMSG_SPACE(2 * sizeof(int))];
+	struct cmsghdr align;
+    } control;
+    struct sockaddr_un addr;
+    struct ds_request req;
+    struct ds_reply reply;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    struct timeval tv;
+    int fds[2];
+    int sock;
+    ssize_t r;
+
+    if (strlen(filename) >= sizeof(req.filename) ||
+        (opts->force_file &&
+         strlen(opts->force_file) >= sizeof(req.force_file)))
+	return -1;
+
+    if (socket_addr(&addr, socket_path) < 0)
+	return -1;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+	return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	ds_printf(DS_LEV_DEBUG, "daemonVerify: cannot connect to %s: %s",
+	          socket_path, strerror(errno));
+	close(sock);
+	return -1;
+    }
+
+    /* Only trust the outcome from a daemon run by root or by ourselves,
+     * whoever got to create the socket. */
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+        (cred.uid != 0 && cred.uid != geteuid())) {
+	ds_printf(DS_LEV_DEBUG, "daemonVerify: not trusting the daemon on %s",
+	          socket_path);
+	close(sock);
+	return -1;
+    }
+
+    tv.tv_sec = DS_REPLY_TIMEOUT;
+    tv.tv_usec = 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+	close(sock);
+	return -1;
+    }
+
+    fds[0] = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fds[0] < 0) {
+	close(sock);
+	return -1;
+    }
+    fds[1] = STDOUT_FILENO;
+
+    memset(&req, 0, sizeof(req));
+    req.magic = DS_REQUEST_MAGIC;
+    req.debug_level = ds_debug_level;
+    req.list_only = opts->list_only;
+    if (opts->force_file)
+	strcpy(req.force_file, opts->force_file);
+    strcpy(req.filename, filename);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    fflush(stdout);
+
+    do {
+	r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (r < 0 && errno == EINTR);
+    close(fds[0]);
+    if (r != sizeof(req)) {
+	close(sock);
+	return -1;
+    }
+
+    r = fd_read(sock, &reply, sizeof(reply));
+    close(sock);
+    if (r != sizeof(reply) || reply.magic != DS_REQUEST_MAGIC) {
+	ds_printf(DS_LEV_DEBUG, "daemonVerify: no reply from %s", socket_path);
+	return -1;
+    }
+
+    return reply.status;
+}
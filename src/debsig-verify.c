@@ -28,257 +28,18 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <fcntl.h>
-#include <dirent.h>
+#include <sys/mman.h>
 
 #include <dpkg/dpkg.h>
-#include <dpkg/string.h>
-#include <dpkg/path.h>
-#include <dpkg/buffer.h>
+#include <dpkg/subproc.h>
 
 #include "debsig.h"
 
-const char *rootdir = "";
-
-const char *policies_dir = DEBSIG_POLICIES_DIR;
-const char *keyrings_dir = DEBSIG_KEYRINGS_DIR;
-
-#define CTAR(x) "control.tar" # x
-#define DTAR(x) "data.tar" # x
-static const char ver_magic_member[] = "debian-binary";
-static const char *ver_ctrl_members[] = {
-	CTAR(), CTAR(.gz), CTAR(.xz), NULL
-};
-static const char *ver_data_members[] = {
-	DTAR(), DTAR(.gz), DTAR(.xz), DTAR(.bz2), DTAR(.lzma), NULL
-};
-
-static int
-checkSelRules(struct dpkg_ar *deb, const char *originID, struct group *grp)
-{
-    int opt_count = 0;
-    struct match *mtc;
-    int len;
-
-    for (mtc = grp->matches; mtc; mtc = mtc->next) {
-        ds_printf(DS_LEV_VER, "      Processing '%s' key...", mtc->name);
-
-        /* If we have an ID for this match, check to make sure it exists, and
-         * matches the signature we are about to check.  */
-        if (mtc->id) {
-            char *m_id = getKeyID(originID, mtc);
-            char *d_id = getSigKeyID(deb, mtc->name);
-            if (m_id == NULL || d_id == NULL || strcmp(m_id, d_id) != 0)
-                return 0;
-        }
-
-	/* XXX: If the match doesn't specify an ID, we need to check to
-	 * make sure the ID of the signature exists in the keyring
-	 * specified, don't we?
-	 */
-
-        len = checkSigExist(deb, mtc->name);
-
-        /* If the member exists and we reject it, fail now. Also, if it
-         * doesn't exist, and we require it, fail as well. */
-        if ((!len && mtc->type == REQUIRED_MATCH) ||
-                (len && mtc->type == REJECT_MATCH)) {
-            return 0;
-        }
-        /* This would mean this is Optional, so we ignore it for now */
-        if (!len)
-            continue;
-
-        /* Kick up the count once for checking later */
-        if (mtc->type == OPTIONAL_MATCH)
-            opt_count++;
-    }
-
-    if (opt_count < grp->min_opt) {
-        ds_printf(DS_LEV_DEBUG, "checkSelRules: opt passed - %d, opt required %d",
-                  opt_count, grp->min_opt);
-        return 0;
-    }
-
-    return 1;
-}
-
-static int
-verifyGroupRules(struct dpkg_ar *deb, const char *originID, struct group *grp)
-{
-    struct dpkg_error err;
-    char *tmp_sig, *tmp_data;
-    int opt_count = 0, t, i, fd;
-    struct match *mtc;
-    off_t len;
-
-    /* Set umask for a more controlled environment. */
-    umask(022);
-
-    /* If we don't have any matches, we fail. We don't want blank,
-     * take-all rules. This actually gets checked while we parse the
-     * policy file, but we check again for good measure.  */
-    if (grp->matches == NULL)
-	return 0;
-
-    /* Go ahead and write out our data to a temp file */
-    tmp_data = path_make_temp_template("debsig-data");
-    if ((fd = mkstemp(tmp_data)) == -1) {
-	ds_printf(DS_LEV_ERR, "error creating temp file %s: %s\n",
-		  tmp_data, strerror(errno));
-	free(tmp_data);
-	return 0;
-    }
-
-    /* Now, let's find all the members we need to check and cat them into a
-     * single temp file. This is what we pass to gpg.  */
-    if (!(len = findMember(deb, ver_magic_member)))
-        goto fail_and_close;
-    len = fd_fd_copy(deb->fd, fd, len, &err);
-    if (len < 0)
-	ohshit("verifyGroupRules: cannot copy to temp file: %s", err.str);
-
-    for (i = 0; ver_ctrl_members[i]; i++) {
-	len = findMember(deb, ver_ctrl_members[i]);
-	if (!len)
-	    continue;
-	len = fd_fd_copy(deb->fd, fd, len, &err);
-	if (len < 0)
-	    ohshit("verifyGroupRules: cannot copy to temp file: %s", err.str);
-	break;
-    }
-    if (!ver_ctrl_members[i])
-	goto fail_and_close;
-
-    for (i = 0; ver_data_members[i]; i++) {
-	len = findMember(deb, ver_data_members[i]);
-	if (!len)
-	    continue;
-	len = fd_fd_copy(deb->fd, fd, len, &err);
-	if (len < 0)
-	    ohshit("verifyGroupRules: cannot copy to temp file: %s", err.str);
-	break;
-    }
-    if (!ver_data_members[i])
-	goto fail_and_close;
-
-    if (close(fd))
-        ohshite("error closing temp file %s", tmp_data);
-    fd = -1;
-
-    for (mtc = grp->matches; mtc; mtc = mtc->next) {
-	ds_printf(DS_LEV_VER, "      Processing '%s' key...", mtc->name);
-
-	/* If we have an ID for this match, check to make sure it exists, and
-	 * matches the signature we are about to check.  */
-	if (mtc->id) {
-	    char *m_id = getKeyID(originID, mtc);
-	    char *d_id = getSigKeyID(deb, mtc->name);
-	    if (m_id == NULL || d_id == NULL || strcmp(m_id, d_id) != 0)
-		goto fail_and_close;
-	}
-
-	/* This will also position deb->fd to the start of the member. */
-	len = checkSigExist(deb, mtc->name);
-
-	/* If the member exists and we reject it, die now. Also, if it
-	 * doesn't exist, and we require it, die as well. */
-	if ((!len && mtc->type == REQUIRED_MATCH) ||
-		(len && mtc->type == REJECT_MATCH)) {
-	    goto fail_and_close;
-	}
-
-	/* This would mean this is Optional, so we ignore it for now */
-	if (!len)
-            continue;
-
-	/* let's get our temp file */
-	tmp_sig = path_make_temp_template("debsig-sig");
-	if ((fd = mkstemp(tmp_sig)) == -1) {
-	    ds_printf(DS_LEV_ERR, "error creating temp file %s: %s\n",
-		      tmp_sig, strerror(errno));
-	    goto fail_and_close;
-	}
-
-	len = fd_fd_copy(deb->fd, fd, len, &err);
-	if (len < 0)
-	    ohshit("verifyGroupRules: cannot copy to temp file: %s", err.str);
-
-	if (close(fd) < 0)
-	    ohshit("error closing temp file %s", tmp_sig);
-
-	/* Now, let's check with gpg on this one */
-	t = gpgVerify(originID, mtc, tmp_data, tmp_sig);
-
-	fd = -1;
-	unlink(tmp_sig);
-	free(tmp_sig);
-
-	/* We fail no matter what now. Even if this is an optional match
-	 * rule, by now, we know that the sig exists, so we must fail */
-	if (!t) {
-	    ds_printf(DS_LEV_DEBUG, "verifyGroupRules: failed for %s", mtc->name);
-	    goto fail_and_close;
-	}
-
-	/* Kick up the count once for checking later */
-	if (mtc->type == OPTIONAL_MATCH)
-	    opt_count++;
-    }
-
-    if (opt_count < grp->min_opt) {
-	ds_printf(DS_LEV_DEBUG, "verifyGroupRules: opt passed - %d, opt required %d",
-		  opt_count, grp->min_opt);
-	goto fail_and_close;
-    }
-
-    unlink(tmp_data);
-    free(tmp_data);
-    return 1;
-
-fail_and_close:
-    unlink(tmp_data);
-    free(tmp_data);
-    if (fd != -1)
-	close(fd);
-    return 0;
-}
-
-static int
-checkIsDeb(struct dpkg_ar *deb)
-{
-    int i;
-    const char *member;
-
-    if (!findMember(deb, ver_magic_member)) {
-       ds_printf(DS_LEV_VER, "Missing archive magic member %s", ver_magic_member);
-       return 0;
-    }
-
-    for (i = 0; (member = ver_ctrl_members[i]); i++)
-        if (findMember(deb, member))
-            break;
-    if (!member) {
-        ds_printf(DS_LEV_VER, "Missing archive control member, checked:");
-        for (i = 0; (member = ver_ctrl_members[i]); i++)
-            ds_printf(DS_LEV_VER, "    %s", member);
-        return 0;
-    }
-
-    for (i = 0; (member = ver_data_members[i]); i++)
-        if (findMember(deb, member))
-            break;
-    if (!member) {
-        ds_printf(DS_LEV_VER, "Missing archive data member, checked:");
-        for (i = 0; (member = ver_data_members[i]); i++)
-            ds_printf(DS_LEV_VER, "    %s", member);
-        return 0;
-    }
-
-    return 1;
-}
+/* What terminates each line of the batch output. */
+static int batch_eol = '\n';
 
 static void
 outputVersion(void)
@@ -300,7 +61,12 @@ outputBadUsage(void)
 static void
 outputUsage(void)
 {
-    printf("Usage: %s [<option>...] <deb>\n\n", dpkg_get_progname());
+    printf("Usage: %s [<option>...] <deb>|-\n"
+           "       %s [<option>...] --fd <n>\n"
+           "       %s [<option>...] --batch [<deb>...]\n"
+           "       %s [<option>...] --compile-policies\n\n",
+           dpkg_get_progname(), dpkg_get_progname(), dpkg_get_progname(),
+           dpkg_get_progname());
 
     printf(
 "Options:\n"
@@ -310,9 +76,21 @@ outputUsage(void)
 "      --list-policies      Only list policies that can be used to validate\n"
 "                             this sig. Only runs through 'Selection' block.\n"
 "      --use-policy <name>  Specify the short policy name to use.\n"
+"      --fd <n>             Verify the package read from file descriptor <n>.\n"
+"      --batch              Verify each <deb> argument, or each NUL-separated\n"
+"                             filename read from stdin if none is given.\n"
+"      --jobs <n>           Verify a batch with <n> worker processes, or one\n"
+"                             per online CPU if <n> is 0.\n"
+"  -z, --null               Terminate batch output lines with NUL, not newline.\n"
+"      --daemon             Serve verification requests on --socket.\n"
+"      --socket <path>      Use the daemon listening on this Unix socket.\n"
 "      --policies-dir <dir> Use an alternative policies directory.\n"
 "      --keyrings-dir <dir> Use an alternative keyrings directory.\n"
+"      --cache-dir <dir>    Use an alternative compiled policies directory.\n"
+"      --compile-policies   Compile the policies of every origin, and exit.\n"
+"      --gpg-cache          Let gpg use prepared keyrings from the cache dir.\n"
 "      --root <dir>         Use an alternative root directory for policy lookup.\n"
+"      --backend <name>     Verify signatures with 'native' (default) or 'gpg'.\n"
 "      --help               Output usage info, and exit.\n"
 "      --version            Output version info, and exit.\n"
 );
@@ -325,34 +103,255 @@ ds_catch_fatal_error(void)
     exit(DS_FAIL_INTERNAL);
 }
 
+/* Remove what the context left on disk when bailing out, such as the
+ * temporary gpg home. */
+static void
+ds_cleanup_ctx(int argc, void **argv)
+{
+    gpg_tmpdir_remove(argv[0]);
+}
+
 static void
 ds_print_fatal_error(const char *emsg, const void *data)
 {
     ds_printf(DS_LEV_ERR, "%s", emsg);
 }
 
+static const char *
+ds_status_name(int rc)
+{
+    switch (rc) {
+    case DS_SUCCESS:
+	return "ok";
+    case DS_FAIL_NOSIGS:
+	return "nosigs";
+    case DS_FAIL_UNKNOWN_ORIGIN:
+	return "unknown-origin";
+    case DS_FAIL_NOPOLICIES:
+	return "nopolicies";
+    case DS_FAIL_BADSIG:
+	return "badsig";
+    default:
+	return "internal";
+    }
+}
+
+static int
+verifyBatchDeb(struct debsig_ctx *ctx, const char *filename,
+               const struct verify_opts *opts)
+{
+    struct debsig_result res;
+    int rc;
+
+    memset(&res, 0, sizeof(res));
+    rc = verifyPackage(ctx, filename, -1, opts, &res);
+    if (res.error)
+	ds_printf(DS_LEV_ERR, "%s: %s", filename, res.error);
+    debsig_result_destroy(&res);
+
+    printf("%d %s %s%c", rc, ds_status_name(rc), filename, batch_eol);
+    fflush(stdout);
+
+    return rc;
+}
+
+/* Read the NUL-separated list of packages from stdin, calling func on
+ * each of them. */
+static void
+readBatchList(void (*func)(const char *filename, void *data), void *data)
+{
+    char *filename = NULL;
+    size_t filename_size = 0;
+    ssize_t len;
+
+    while ((len = getdelim(&filename, &filename_size, '\0', stdin)) > 0) {
+	if (filename[len - 1] == '\0')
+	    len--;
+	if (len == 0)
+	    continue;
+	filename[len] = '\0';
+
+	func(filename, data);
+    }
+    if (ferror(stdin))
+	ohshite("cannot read package list from stdin");
+    free(filename);
+}
+
+struct batch_status {
+    struct debsig_ctx *ctx;
+    const struct verify_opts *opts;
+    int status;
+};
+
+static void
+verifyBatchItem(const char *filename, void *data)
+{
+    struct batch_status *bs = data;
+    int rc;
+
+    rc = verifyBatchDeb(bs->ctx, filename, bs->opts);
+    if (rc > bs->status)
+	bs->status = rc;
+}
+
+struct batch_list {
+    char **files;
+    int nfiles;
+    int nalloc;
+};
+
+static void
+addBatchItem(const char *filename, void *data)
+{
+    struct batch_list *list = data;
+
+    if (list->nfiles == list->nalloc) {
+	list->nalloc = list->nalloc ? list->nalloc * 2 : 64;
+	list->files = m_realloc(list->files,
+	                        list->nalloc * sizeof(*list->files));
+    }
+    list->files[list->nfiles++] = m_strdup(filename);
+}
+
+/* The work queue shared with the worker processes. Each idle worker takes
+ * the next package in line, so a large package only holds up the worker
+ * checking it. */
+struct batch_queue {
+    int next;
+    int status[];
+};
+
+static int
+verifyBatchPool(struct debsig_ctx *ctx, char **files, int nfiles, int jobs,
+                const struct verify_opts *opts)
+{
+    struct batch_queue *queue;
+    size_t queue_size;
+    pid_t *pids;
+    int i, rc, status = DS_SUCCESS;
+
+    if (jobs > nfiles)
+	jobs = nfiles;
+
+    queue_size = sizeof(*queue) + nfiles * sizeof(queue->status[0]);
+    queue = mmap(NULL, queue_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (queue == MAP_FAILED)
+	ohshite("cannot allocate the batch work queue");
+    queue->next = 0;
+    for (i = 0; i < nfiles; i++)
+	queue->status[i] = -1;
+
+    ds_printf(DS_LEV_DEBUG, "verifyBatchPool: %d packages on %d workers",
+              nfiles, jobs);
+
+    /* Do not let the workers inherit pending output. */
+    fflush(stdout);
+
+    pids = m_malloc(jobs * sizeof(*pids));
+    for (i = 0; i < jobs; i++) {
+	pids[i] = subproc_fork();
+	if (pids[i] == 0) {
+	    int n;
+
+	    while ((n = __atomic_fetch_add(&queue->next, 1,
+	                                   __ATOMIC_RELAXED)) < nfiles)
+		queue->status[n] = verifyBatchDeb(ctx, files[n], opts);
+	    gpg_tmpdir_remove(ctx);
+	    exit(0);
+	}
+    }
+
+    for (i = 0; i < jobs; i++) {
+	rc = subproc_reap(pids[i], "verification worker",
+	                  SUBPROC_RETERROR | SUBPROC_RETSIGNO);
+	if (rc != 0)
+	    ds_printf(DS_LEV_ERR, "verification worker %d failed", pids[i]);
+    }
+    free(pids);
+
+    for (i = 0; i < nfiles; i++) {
+	rc = queue->status[i];
+	if (rc < 0) {
+	    /* The worker died before getting to report this one. */
+	    rc = DS_FAIL_INTERNAL;
+	    printf("%d %s %s%c", rc, ds_status_name(rc), files[i], batch_eol);
+	}
+	if (rc > status)
+	    status = rc;
+    }
+
+    munmap(queue, queue_size);
+
+    return status;
+}
+
+static int
+verifyBatch(struct debsig_ctx *ctx, int argc, char *argv[], int jobs,
+            const struct verify_opts *opts)
+{
+    struct batch_list list = { NULL, 0, 0 };
+    int i, status = DS_SUCCESS;
+
+    if (jobs == 1) {
+	struct batch_status bs = { ctx, opts, DS_SUCCESS };
+
+	for (i = 0; i < argc; i++)
+	    verifyBatchItem(argv[i], &bs);
+	if (argc == 0)
+	    readBatchList(verifyBatchItem, &bs);
+	return bs.status;
+    }
+
+    for (i = 0; i < argc; i++)
+	addBatchItem(argv[i], &list);
+    if (argc == 0)
+	readBatchList(addBatchItem, &list);
+
+    if (list.nfiles > 0)
+	status = verifyBatchPool(ctx, list.files, list.nfiles, jobs, opts);
+
+    for (i = 0; i < list.nfiles; i++)
+	free(list.files[i]);
+    free(list.files);
+
+    return status;
+}
+
 int
 main(int argc, char *argv[])
 {
-    struct dpkg_ar *deb;
-    struct policy *pol = NULL;
-    char *originID;
-    char *origin_dir = NULL, *pol_file = NULL, *force_file = NULL;
-    DIR *pd = NULL;
-    struct dirent *pd_ent;
-    struct group *grp;
-    int i, list_only = 0;
+    struct verify_opts opts = { 0, NULL };
+    struct debsig_ctx *ctx;
+    struct debsig_result res;
+    const char *socket_path;
+    const char *filename;
+    char fd_name[32];
+    const char *rootdir = NULL;
+    const char *policies_dir = NULL;
+    const char *keyrings_dir = NULL;
+    const char *cache_dir = NULL;
+    enum debsig_backend backend = DEBSIG_BACKEND_NATIVE;
+    int i, rc, batch = 0, jobs = 1, serve = 0, compile = 0, local_config = 0;
+    int gpg_cache = 0;
+    int fd = -1;
 
     dpkg_set_progname(argv[0]);
 
     push_error_context_func(ds_catch_fatal_error, ds_print_fatal_error, NULL);
 
-    if (argc < 2) {
+    socket_path = getenv("DEBSIG_VERIFYD_SOCKET");
+    if (strcmp(dpkg_get_progname(), "debsig-verifyd") == 0)
+	serve = 1;
+
+    if (argc < 2 && !serve) {
 	ds_printf(DS_LEV_ERR, "missing <deb> filename argument");
 	outputBadUsage();
     }
 
-    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    /* A lone '-' is the package read from stdin. */
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
 	if (strcmp(argv[i], "-v") == 0|| strcmp(argv[i], "--verbose") == 0)
 	    ds_debug_level = DS_LEV_VER;
 	else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0)
@@ -376,29 +375,107 @@ main(int argc, char *argv[])
 	    exit(0);
 	} else if (strcmp(argv[i], "--list-policies") == 0) {
 	    /* Just create a list of policies we can use */
-	    list_only = 1;
+	    opts.list_only = 1;
 	    ds_printf(DS_LEV_ALWAYS, "Listing usable policies");
+	} else if (strcmp(argv[i], "--batch") == 0) {
+	    batch = 1;
+	} else if (strcmp(argv[i], "-z") == 0 || strcmp(argv[i], "--null") == 0) {
+	    batch_eol = '\0';
+	} else if (strcmp(argv[i], "--compile-policies") == 0) {
+	    compile = 1;
+	} else if (strcmp(argv[i], "--gpg-cache") == 0) {
+	    gpg_cache = 1;
+	    local_config = 1;
+	} else if (strcmp(argv[i], "--daemon") == 0) {
+	    serve = 1;
+	} else if (strcmp(argv[i], "--socket") == 0) {
+	    socket_path = argv[++i];
+	    if (i == argc || socket_path[0] == '-') {
+		ds_printf(DS_LEV_ERR, "--socket requires an argument");
+		outputBadUsage();
+	    }
+	} else if (strcmp(argv[i], "--jobs") == 0) {
+	    const char *arg = argv[++i];
+	    char *end;
+	    long n;
+
+	    if (i == argc || arg[0] == '-') {
+		ds_printf(DS_LEV_ERR, "--jobs requires an argument");
+		outputBadUsage();
+	    }
+	    errno = 0;
+	    n = strtol(arg, &end, 10);
+	    if (errno || *end != '\0' || n < 0 || n > INT_MAX) {
+		ds_printf(DS_LEV_ERR, "invalid number of jobs '%s'", arg);
+		outputBadUsage();
+	    }
+	    if (n == 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	    jobs = n > 0 ? n : 1;
+	} else if (strcmp(argv[i], "--fd") == 0) {
+	    const char *arg = argv[++i];
+	    char *end;
+	    long n;
+
+	    if (i == argc || arg[0] == '-') {
+		ds_printf(DS_LEV_ERR, "--fd requires an argument");
+		outputBadUsage();
+	    }
+	    errno = 0;
+	    n = strtol(arg, &end, 10);
+	    if (errno || *end != '\0' || n < 0 || n > INT_MAX) {
+		ds_printf(DS_LEV_ERR, "invalid file descriptor '%s'", arg);
+		outputBadUsage();
+	    }
+	    fd = n;
 	} else if (strcmp(argv[i], "--use-policy") == 0) {
 	    /* We take one arg */
-	    force_file = argv[++i];
-	    if (i == argc || force_file[0] == '-') {
+	    opts.force_file = argv[++i];
+	    if (i == argc || opts.force_file[0] == '-') {
 		ds_printf(DS_LEV_ERR, "--use-policy requires an argument");
 		outputBadUsage();
 	    }
 	} else if (strcmp(argv[i], "--policies-dir") == 0) {
 	    policies_dir = argv[++i];
+	    local_config = 1;
 	    if (i == argc || policies_dir[0] == '-') {
 		ds_printf(DS_LEV_ERR, "--policies-dir requires an argument");
 		outputUsage();
 	    }
 	} else if (strcmp(argv[i], "--keyrings-dir") == 0) {
 	    keyrings_dir = argv[++i];
+	    local_config = 1;
 	    if (i == argc || keyrings_dir[0] == '-') {
 		ds_printf(DS_LEV_ERR, "--keyrings-dir requires an argument");
 		outputUsage();
 	    }
+	} else if (strcmp(argv[i], "--cache-dir") == 0) {
+	    cache_dir = argv[++i];
+	    local_config = 1;
+	    if (i == argc || cache_dir[0] == '-') {
+		ds_printf(DS_LEV_ERR, "--cache-dir requires an argument");
+		outputBadUsage();
+	    }
+	} else if (strcmp(argv[i], "--backend") == 0) {
+	    const char *name = argv[++i];
+
+	    local_config = 1;
+
+	    if (i == argc || name[0] == '-') {
+		ds_printf(DS_LEV_ERR, "--backend requires an argument");
+		outputBadUsage();
+	    }
+	    if (strcmp(name, "native") == 0)
+		backend = DEBSIG_BACKEND_NATIVE;
+	    else if (strcmp(name, "gpg") == 0)
+		backend = DEBSIG_BACKEND_GPG;
+	    else {
+		ds_printf(DS_LEV_ERR, "unknown backend '%s'", name);
+		outputBadUsage();
+	    }
 	} else if (strcmp(argv[i], "--root") == 0) {
 	    rootdir = argv[++i];
+	    local_config = 1;
 	    if (i == argc || rootdir[0] == '-') {
 		ds_printf(DS_LEV_ERR, "--root requires an argument");
 		outputBadUsage();
@@ -410,108 +487,108 @@ main(int argc, char *argv[])
 	}
     }
 
-    /* There should only be one arg left. */
-    if (i + 1 != argc) {
-	ds_printf(DS_LEV_ERR, "too many arguments");
+    ctx = debsig_ctx_new();
+    if (ctx == NULL)
+	ohshite("cannot create verification context");
+    if ((rootdir && debsig_ctx_set_root(ctx, rootdir) < 0) ||
+        (policies_dir && debsig_ctx_set_policies_dir(ctx, policies_dir) < 0) ||
+        (keyrings_dir && debsig_ctx_set_keyrings_dir(ctx, keyrings_dir) < 0) ||
+        (cache_dir && debsig_ctx_set_cache_dir(ctx, cache_dir) < 0))
+	ohshite("cannot set up verification context");
+    push_cleanup(ds_cleanup_ctx, ehflag_bombout, 1, ctx);
+    debsig_ctx_set_backend(ctx, backend);
+    debsig_ctx_set_gpg_cache(ctx, gpg_cache);
+    ctx->log_level = ds_debug_level;
+
+    if ((serve || batch) && fd >= 0) {
+	ds_printf(DS_LEV_ERR, "--fd cannot be used with --batch or --daemon");
+	outputBadUsage();
+    }
+    if (!batch && batch_eol != '\n') {
+	ds_printf(DS_LEV_ERR, "--null can only be used with --batch");
 	outputBadUsage();
     }
 
-    deb = dpkg_ar_open(argv[i]);
-
-    if (!list_only)
-	ds_printf(DS_LEV_VER, "Starting verification for: %s", deb->name);
-
-    if (!checkIsDeb(deb))
-	ohshit("%s does not appear to be a deb format package", deb->name);
-
-    originID = getSigKeyID(deb, "origin");
-    if (originID == NULL)
-	ds_fail_printf(DS_FAIL_NOSIGS, "Origin Signature check failed. This deb might not be signed.\n");
-
-    /* Now we have an ID, let's check the policy to use */
-    m_asprintf(&origin_dir, "%s%s/%s", rootdir, policies_dir, originID);
-
-    pd = opendir(origin_dir);
-    if (pd == NULL)
-	ds_fail_printf(DS_FAIL_UNKNOWN_ORIGIN,
-                       "Could not open Origin directory %s: %s\n",
-                       origin_dir, strerror(errno));
-
-    ds_printf(DS_LEV_VER, "Using policy directory: %s", origin_dir);
-
-    if (list_only)
-        ds_printf(DS_LEV_ALWAYS, "  Policies in: %s", origin_dir);
-
-    while ((pd_ent = readdir(pd)) != NULL && (pol == NULL || list_only)) {
-        free(pol_file);
-        pol_file = NULL;
-
-	/* Make sure we have the right name format */
-	if (!str_match_end(pd_ent->d_name, ".pol"))
-	    continue;
-
-	if (force_file != NULL && strcmp(pd_ent->d_name, force_file) != 0)
-	    continue;
-
-	/* Now try to parse the file */
-        m_asprintf(&pol_file, "%s/%s", origin_dir, pd_ent->d_name);
-	ds_printf(DS_LEV_VER, "  Parsing policy file: %s", pol_file);
-	pol = parsePolicyFile(pol_file);
-
-	if (pol == NULL)
-	    continue;
-
-	/* Now let's see if this policy's selection is useful for this .deb  */
-	ds_printf(DS_LEV_VER, "    Checking Selection group(s).");
-	for (grp = pol->sels; grp != NULL; grp = grp->next) {
-	    if (!checkSelRules(deb, originID, grp)) {
-		clear_policy();
-		ds_printf(DS_LEV_VER, "    Selection group failed checks.");
-		pol = NULL;
-		break;
-	    }
+    if (compile) {
+	if (i != argc) {
+	    ds_printf(DS_LEV_ERR, "--compile-policies accepts no <deb> arguments");
+	    outputBadUsage();
 	}
-
-	if (pol && list_only) {
-	    ds_printf(DS_LEV_ALWAYS, "    Usable: %s", pd_ent->d_name);
-	    list_only++;
-	} else if (pol)
-	    ds_printf(DS_LEV_VER, "    Selection group(s) passed, policy is usable.");
+	rc = policy_cache_compile_all(ctx) < 0 ? 1 : 0;
+	debsig_ctx_free(ctx);
+	pop_error_context(ehflag_normaltidy);
+	exit(rc);
     }
-    closedir(pd);
-
-    free(origin_dir);
-
-    if ((pol == NULL && !list_only) || list_only == 1) /* Damn, can't verify this one */
-	ds_fail_printf(DS_FAIL_NOPOLICIES, "No applicable policy found.");
 
-    if (list_only)
-	exit(0); /* our job is done */
-
-    ds_printf(DS_LEV_VER, "Using policy file: %s", pol_file);
-    free(pol_file);
+    /* Repeated verifications get their gpg started from a launcher forked
+     * now, before anything gets loaded, instead of forking from a process
+     * that keeps on growing. The native backend might never need gpg, so
+     * it only gets one on the first fallback. */
+    if ((serve || batch) && backend == DEBSIG_BACKEND_GPG) {
+	if (gpg_launcher_start() < 0)
+	    ds_printf(DS_LEV_DEBUG, "cannot start the gpg launcher: %s",
+	              strerror(errno));
+    } else if (serve || batch) {
+	gpg_launcher_defer();
+    }
 
-    /* This should actually be caught in the xml-parsing. */
-    if (pol->vers == NULL)
-	ds_fail_printf(DS_FAIL_NOPOLICIES, "Failed, no Verification groups in policy.");
+    if (serve) {
+	if (socket_path == NULL) {
+	    ds_printf(DS_LEV_ERR, "--daemon requires --socket");
+	    outputBadUsage();
+	}
+	if (i != argc) {
+	    ds_printf(DS_LEV_ERR, "--daemon accepts no <deb> arguments");
+	    outputBadUsage();
+	}
+	rc = daemonRun(ctx, socket_path, jobs);
+	debsig_ctx_free(ctx);
+	pop_error_context(ehflag_normaltidy);
+	exit(rc);
+    }
 
-    /* Now the final test */
-    ds_printf(DS_LEV_VER, "    Checking Verification group(s).");
+    if (batch) {
+	rc = verifyBatch(ctx, argc - i, argv + i, jobs, &opts);
+	debsig_ctx_free(ctx);
+	pop_error_context(ehflag_normaltidy);
+	exit(rc);
+    }
 
-    for (grp = pol->vers; grp; grp = grp->next) {
-	if (!verifyGroupRules(deb, originID, grp)) {
-	    ds_printf(DS_LEV_VER, "    Verification group failed checks.");
-	    ds_fail_printf(DS_FAIL_BADSIG, "Failed verification for %s.", deb->name);
+    /* There should only be one arg left, unless reading from --fd. */
+    if (fd >= 0) {
+	if (i != argc) {
+	    ds_printf(DS_LEV_ERR, "--fd accepts no <deb> argument");
+	    outputBadUsage();
 	}
+	snprintf(fd_name, sizeof(fd_name), "fd %d", fd);
+	filename = fd_name;
+    } else if (i + 1 != argc) {
+	ds_printf(DS_LEV_ERR, "too many arguments");
+	outputBadUsage();
+    } else {
+	filename = argv[i];
     }
 
-    ds_printf(DS_LEV_VER, "    Verification group(s) passed, deb is validated.");
+    /* Let a running daemon do the work if there is one, unless we have
+     * been asked for a different setup than the one it serves, or the
+     * package comes from a stream only we can read. */
+    if (socket_path && !local_config && fd < 0 && strcmp(filename, "-") != 0) {
+	rc = daemonVerify(socket_path, filename, &opts);
+	if (rc >= 0) {
+	    pop_error_context(ehflag_normaltidy);
+	    exit(rc);
+	}
+    }
 
-    ds_printf(DS_LEV_INFO, "Verified package from '%s' (%s)",
-	      pol->description, pol->name);
+    memset(&res, 0, sizeof(res));
+    rc = verifyPackage(ctx, filename, fd, &opts, &res);
+    if (res.error)
+	ds_printf(DS_LEV_ERR, "%s", res.error);
+    debsig_result_destroy(&res);
+    debsig_ctx_free(ctx);
 
     pop_error_context(ehflag_normaltidy);
 
-    /* If we get here, then things passed just fine */
-    exit(DS_SUCCESS);
+    /* If we get here, then things went as far as they could */
+    exit(rc);
 }
@@ -18,10 +18,22 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <obstack.h>
+
+#include <dpkg/error.h>
 #include <dpkg/ar.h>
+#include <dpkg/command.h>
 
-#define SIG_MAGIC ":signature packet:"
-#define USER_MAGIC ":user ID packet:"
+#include "libdebsig.h"
+
+#define GPG_STATUS_PREFIX "[GNUPG:] "
 
 #define OPTIONAL_MATCH 1
 #define REQUIRED_MATCH 2
@@ -30,68 +42,555 @@
 #define SIG_VERSION "1.0"
 #define DEBSIG_NAMESPACE "https://www.debian.org/debsig/"SIG_VERSION"/"
 
+/* Signature types get interned per context to small integers, so that
+ * the signatures present in a package and the ones a group refers to can
+ * be compared as bitmasks. */
+typedef uint64_t sig_mask_t;
+#define SIG_TYPES_MAX 64
+#define SIG_TYPE_BIT(type) ((sig_mask_t)1 << (type))
+
 struct match {
-        struct match *next;
         int type;
         char *name;
         char *file;
         char *id;
         int day_expiry;
+        /* The interned signature type, once bound to a context. */
+        int sig_type;
 };
 
 struct group {
-        struct group *next;
         struct match *matches;
+        int nmatches;
         int min_opt;
+        /* The signature types of the Required, Optional and Reject
+         * matches, and of the matches that name a key ID. */
+        sig_mask_t required;
+        sig_mask_t optional;
+        sig_mask_t reject;
+        sig_mask_t with_id;
+        /* Whether several Optional matches share a type, so that they
+         * cannot simply be counted by their bits. */
+        bool opt_shared;
 };
 
 struct policy {
+        /* Arena holding the policy and everything it points to. */
+        struct obstack obs;
         char *name;
         char *id;
         char *description;
         struct group *sels;
+        int nsels;
         struct group *vers;
+        int nvers;
+        /* Whether only the Origin and Selection blocks got loaded. */
+        bool partial;
+        /* Whether the signature types got bound to a context. */
+        bool bound;
+};
+
+/* Per-package verification options. */
+struct verify_opts {
+        int list_only;
+        const char *force_file;
+};
+
+struct ar_member {
+        char name[sizeof(((struct dpkg_ar_hdr *)0)->ar_name) + 1];
+        off_t offset;
+        off_t size;
+        /* The member contents, when loaded in memory. */
+        void *data;
+};
+
+#define DEB_SIGNED_MEMBERS 3
+
+/* Outcome of checking a signature member against a keyring, so that
+ * each signature gets its signed data hashed at most once per package. */
+struct sig_result {
+        struct sig_result *next;
+        const struct ar_member *sig;
+        char *file;
+        int valid;
+};
+
+/* Minimal hash table, keyed by arbitrary bytes. */
+struct ds_hash_entry {
+        struct ds_hash_entry *next;
+        unsigned int hash;
+        const void *key;
+        size_t len;
+        void *value;
+};
+
+struct ds_hash {
+        struct ds_hash_entry **buckets;
+        size_t size;
+        size_t count;
+};
+
+unsigned int
+ds_hash_key(const void *key, size_t len);
+void
+ds_hash_init(struct ds_hash *h);
+void *
+ds_hash_get(const struct ds_hash *h, const void *key, size_t len);
+void
+ds_hash_put(struct ds_hash *h, const void *key, size_t len, void *value);
+void
+ds_hash_destroy(struct ds_hash *h);
+
+/* Interned strings, which live until the table gets destroyed. */
+struct ds_strtab {
+        struct obstack obs;
+        struct ds_hash index;
+};
+
+void
+ds_strtab_init(struct ds_strtab *tab);
+char *
+ds_strtab_intern(struct ds_strtab *tab, const char *str);
+void
+ds_strtab_destroy(struct ds_strtab *tab);
+
+/* OpenPGP packet parsing. */
+#define PGP_PKT_SIGNATURE 2
+#define PGP_PKT_PUBLIC_KEY 6
+#define PGP_PKT_USER_ID 13
+#define PGP_PKT_PUBLIC_SUBKEY 14
+#define PGP_PKT_USER_ATTRIBUTE 17
+
+#define PGP_SUBPKT_CREATION_TIME 2
+#define PGP_SUBPKT_SIG_EXPIRATION 3
+#define PGP_SUBPKT_KEY_EXPIRATION 9
+#define PGP_SUBPKT_ISSUER 16
+#define PGP_SUBPKT_KEY_FLAGS 27
+#define PGP_SUBPKT_EMBEDDED_SIG 32
+#define PGP_SUBPKT_ISSUER_FPR 33
+
+#define PGP_SIG_BINARY 0x00
+#define PGP_SIG_CERT_GENERIC 0x10
+#define PGP_SIG_CERT_POSITIVE 0x13
+#define PGP_SIG_SUBKEY_BINDING 0x18
+#define PGP_SIG_PRIMARY_BINDING 0x19
+#define PGP_SIG_DIRECT_KEY 0x1f
+#define PGP_SIG_KEY_REVOCATION 0x20
+#define PGP_SIG_SUBKEY_REVOCATION 0x28
+#define PGP_SIG_CERT_REVOCATION 0x30
+
+#define PGP_KEY_FLAG_SIGN 0x02
+
+#define PGP_OK 0
+#define PGP_ERR_END -1
+#define PGP_ERR_MALFORMED -2
+#define PGP_ERR_UNSUPPORTED -3
+
+/* Largest signature member we are willing to load into memory. */
+#define SIG_MAX_SIZE (1024 * 1024)
+
+struct pgp_sig {
+        int version;
+        int sig_class;
+        int pubkey_algo;
+        int hash_algo;
+        time_t created;
+        /* The signature and key lifetimes, in seconds, 0 if unlimited. */
+        time_t expires;
+        time_t key_expires;
+        /* The key flags, or -1 if not given. */
+        int key_flags;
+        /* Whether the hashed area has a critical subpacket we do not know
+         * about, which makes the signature unusable natively. */
+        bool critical_unknown;
+        bool has_keyid;
+        uint8_t keyid[8];
+        size_t fpr_len;
+        uint8_t fpr[32];
+        uint8_t left16[2];
+        /* The embedded signature, such as the back signature of a signing
+         * subkey, pointing into the packet. */
+        const uint8_t *embedded;
+        size_t embedded_len;
+        /* The signature packet body, with the offsets of the part covered
+         * by the hash and of the algorithm specific MPIs. */
+        const uint8_t *packet;
+        size_t packet_len;
+        size_t hashed_off;
+        size_t hashed_len;
+        size_t mpi_off;
+};
+
+/* What we know about a signature member, parsed once per package. */
+struct deb_sig {
+        const struct ar_member *mem;
+        /* PGP_OK if the signature packet could be parsed, or why not. */
+        int status;
+        struct pgp_sig sig;
+        /* The issuer key ID, from the packet, or from the gpg status output
+         * for packets we cannot parse, once keyid_done is set. */
+        char *keyid;
+        bool keyid_done;
+};
+
+struct deb_archive {
+        struct dpkg_ar *ar;
+        /* The whole archive, when it could be mapped in memory. */
+        const uint8_t *map;
+        size_t map_len;
+        struct ar_member *members;
+        int nmembers;
+        int members_size;
+        /* The debian-binary, control.tar* and data.tar* members, in the
+         * order they get signed, filled in by checkIsDeb(). */
+        const struct ar_member *signed_members[DEB_SIGNED_MEMBERS];
+        struct sig_result *results;
+        struct deb_digest *digest;
+        /* The signature members, parsed on first use. */
+        struct deb_sig *sigs;
+        int nsigs;
+        bool sigs_loaded;
+        /* Whether gpg got asked for the key IDs of the signatures not
+         * parsed. */
+        bool sigs_gpg_asked;
+        /* The interned signature types known to be present, out of the
+         * first sig_types_checked ones of the context. */
+        sig_mask_t sig_present;
+        int sig_types_checked;
+        /* A package read from a stream gets its payload hashed as it goes
+         * past, while being copied to a temporary file to read the rest
+         * back from. These are the members that got hashed, in order. */
+        bool stream;
+        int nhashed;
+        int hashed[DEB_SIGNED_MEMBERS];
+};
+
+struct pgp_key {
+        struct pgp_key *next;
+        struct pgp_key *primary;
+        int version;
+        int pubkey_algo;
+        time_t created;
+        uint8_t keyid[8];
+        char keyid_str[17];
+        size_t fpr_len;
+        uint8_t fpr[32];
+        /* The key packet body, which its self-signatures cover. */
+        const uint8_t *packet;
+        size_t packet_len;
+        /* Algorithm specific public key material, for verification. */
+        const uint8_t *material;
+        size_t material_len;
+        /* What the valid self-signatures over the key say about it: for a
+         * primary key, those on its user IDs and on itself, for a subkey,
+         * its binding signatures. The expiry and flags come from the
+         * latest one. It stays bound until the last of them expires, or
+         * for ever if bound_until is 0. */
+        bool bound;
+        time_t bound_at;
+        time_t bound_until;
+        bool revoked;
+        time_t revoked_at;
+        time_t expires;
+        int flags;
+        /* Whether a signing subkey has a valid back signature. */
+        bool cross_certified;
+        /* Whether some of its self-signatures could not be checked, so
+         * that gpg needs to be asked instead. */
+        bool unchecked;
+};
+
+/* A user ID of a key with a valid self-signature, until the last of them
+ * expires, or for ever if expires is 0. Other keys with the same user ID
+ * follow it in same. */
+struct key_uid {
+        struct key_uid *next;
+        struct key_uid *same;
+        const struct pgp_key *key;
+        time_t expires;
+};
+
+/* A user ID resolved to a key ID in a keyring, or to nothing, which holds
+ * until expires, if not 0. */
+struct keyring_uid {
+        struct keyring_uid *next;
+        char *keyid;
+        time_t expires;
+        char uid[];
+};
+
+struct keyring {
+        struct keyring *next;
+        char *path;
+        /* The identity of the file loaded, to notice when it changes. */
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        /* The context generation when the file was last checked. */
+        unsigned long checked;
+        int status;
+        uint8_t *data;
+        size_t len;
+        struct pgp_key *keys;
+        struct key_uid *key_uids;
+        struct ds_hash by_uid;
+        struct ds_hash by_keyid;
+        struct keyring_uid *uids;
+        struct ds_hash resolved;
+};
+
+/* The policies of an origin whose Selection presence rules pass for a set
+ * of signature types, in priority order. */
+struct policy_decision {
+        struct policy_decision *next;
+        sig_mask_t present;
+        int npols;
+        int pols[];
+};
+
+/* The size and modification time of a policy file when it got listed. */
+struct policy_stamp {
+        off_t size;
+        struct timespec mtime;
+};
+
+/* The policy files of an origin, sorted by name, either listed from its
+ * directory or taken from its compiled image. */
+struct origin_policies {
+        struct origin_policies *next;
+        char *originID;
+        char *dir;
+        int err;
+        char **files;
+        int nfiles;
+        /* The identity of the directory and of its policy files when they
+         * got listed, to notice when they change. */
+        dev_t dir_dev;
+        ino_t dir_ino;
+        struct timespec dir_mtime;
+        struct policy_stamp *stamps;
+        /* The context generation when they were last checked. */
+        unsigned long checked;
+        /* The policies parsed so far, which stay loaded for the next
+         * packages of the same origin. */
+        struct policy **pols;
+        bool *loaded;
+        /* The strings of the policies, shared among them. */
+        struct ds_strtab strings;
+        /* The decision index, once all the policies got loaded, keyed by
+         * the signature types present out of the ones they refer to. */
+        bool indexed;
+        sig_mask_t sig_types;
+        struct ds_hash decisions;
+        struct policy_decision *decision_list;
+        /* The compiled image of the directory, if it is up to date. */
+        const uint8_t *image;
+        size_t image_len;
+};
+
+/* The library context, holding the configuration and the policies and
+ * keyrings loaded so far. */
+struct debsig_ctx {
+        char *rootdir;
+        char *policies_dir;
+        char *keyrings_dir;
+        char *cache_dir;
+        enum debsig_backend backend;
+        /* Whether gpg runs use the prepared gpg homes in cache_dir. */
+        bool gpg_cache;
+        int log_level;
+        /* The interned signature type names. */
+        struct ds_hash sig_types;
+        char *sig_type_names[SIG_TYPES_MAX];
+        int nsig_types;
+        /* Bumped for every package, so that keyrings get checked for
+         * changes once per package. */
+        unsigned long generation;
+        struct origin_policies *origins;
+        struct keyring *keyrings;
+        struct ds_hash keyring_index;
+        /* The temporary gpg home, and the process that created it. */
+        char *gpg_tmpdir;
+        pid_t gpg_tmpdir_pid;
 };
 
+int
+pgp_dearmor(const char *text, size_t len, uint8_t **out, size_t *out_len);
+int
+pgp_packet_next(const uint8_t **data, size_t *len,
+                int *tag, const uint8_t **body, size_t *body_len);
+int
+pgp_parse_sig_packet(const uint8_t *p, size_t len, struct pgp_sig *sig);
+int
+pgp_parse_sig(const void *data, size_t len, struct pgp_sig *sig);
+void
+pgp_sig_destroy(struct pgp_sig *sig);
+void
+pgp_keyid_str(const uint8_t *keyid, char *buf);
+
+void
+pgp_crypto_init(void);
+struct keyring *
+keyring_get(struct debsig_ctx *ctx, const char *path, int *status);
+void
+keyring_cache_free(struct debsig_ctx *ctx);
+const struct keyring_uid *
+keyring_uid_get(const struct keyring *kr, const char *uid, time_t now);
+const struct keyring_uid *
+keyring_uid_put(struct keyring *kr, const char *uid, const char *keyid,
+                time_t expires);
+const struct key_uid *
+keyring_find_uid(const struct keyring *kr, const char *uid, time_t now);
+const struct pgp_key *
+keyring_find_keyid(const struct keyring *kr, const uint8_t *keyid);
+int
+keyring_key_usable(const struct pgp_key *key, time_t now);
+
 struct policy *
-parsePolicyFile(const char *filename);
+parsePolicyFile(const char *filename, struct ds_strtab *strings,
+                bool selection_only);
+void
+policy_free(struct policy *pol);
+struct deb_archive *
+deb_archive_open(const char *filename);
+struct deb_archive *
+deb_archive_fdopen(const char *filename, int fd);
+void
+deb_archive_close(struct deb_archive *deb);
+bool
+deb_archive_stream_hashed(const struct deb_archive *deb);
+const struct ar_member *
+findMember(struct deb_archive *deb, const char *name);
+typedef int member_data_func(const void *buf, size_t len, void *data,
+                             struct dpkg_error *err);
+
 off_t
-findMember(struct dpkg_ar *deb, const char *name);
+readMemberData(struct deb_archive *deb, const struct ar_member *mem,
+               member_data_func *func, void *data, struct dpkg_error *err);
 off_t
-checkSigExist(struct dpkg_ar *deb, const char *name);
-char *
-getKeyID(const char *originID, const struct match *mtc);
+copyMember(struct deb_archive *deb, const struct ar_member *mem, int fd,
+           struct dpkg_error *err);
+const void *
+readMember(struct deb_archive *deb, const struct ar_member *mem,
+           struct dpkg_error *err);
+off_t
+readSignedData(struct deb_archive *deb, member_data_func *func, void *data,
+               struct dpkg_error *err);
+off_t
+copySignedData(struct deb_archive *deb, int fd, struct dpkg_error *err);
+const struct ar_member *
+checkSigExist(struct deb_archive *deb, const char *name);
 char *
-getSigKeyID(struct dpkg_ar *deb, const char *type);
+ds_keyring_path(const struct debsig_ctx *ctx, const char *originID,
+                const char *file);
+bool
+ds_cache_trusted(const char *path, const struct stat *st);
+const char *
+getKeyID(struct debsig_ctx *ctx, const char *originID,
+         const struct match *mtc);
+struct deb_sig *
+getSig(struct deb_archive *deb, const struct ar_member *mem);
+void
+deb_sigs_free(struct deb_archive *deb);
+const char *
+getSigKeyID(struct debsig_ctx *ctx, struct deb_archive *deb,
+            const char *type);
+int
+gpgVerify(struct debsig_ctx *ctx, const char *originID, struct match *mtc,
+          struct deb_archive *deb, const struct ar_member *mem,
+          const char *sig);
+/* A running gpg, either our child, or one of the launcher waited for
+ * through reply_fd. */
+struct gpg_proc {
+        pid_t pid;
+        int reply_fd;
+};
+
+/* The signal mask saved while SIGPIPE is held off for writing to gpg. */
+struct gpg_sigpipe {
+        sigset_t oldmask;
+        bool pending;
+};
+
 int
-gpgVerify(const char *originID, struct match *mtc,
-          const char *data, const char *sig);
+gpg_launcher_start(void);
 void
-clear_policy(void);
+gpg_launcher_defer(void);
+void
+gpg_tmpdir_remove(struct debsig_ctx *ctx);
+void
+gpg_pipe(int fds[2]);
+void
+gpg_sigpipe_block(struct gpg_sigpipe *sp);
+void
+gpg_sigpipe_restore(struct gpg_sigpipe *sp);
+void
+gpg_spawn(struct gpg_proc *proc, struct command *cmd, int fd_in, int fd_out);
+int
+gpg_wait(struct gpg_proc *proc, const char *desc);
+
+int
+pgp_check_key_sig(const struct pgp_key *signer, const struct pgp_sig *sig,
+                  const struct pgp_key *key, const struct pgp_key *subkey,
+                  const uint8_t *uid, size_t uid_len);
+int
+pgpVerify(struct debsig_ctx *ctx, const char *originID,
+          const struct match *mtc, struct deb_archive *deb,
+          const struct ar_member *mem);
+struct deb_digest *
+deb_digest_new(void);
+void
+deb_digest_write(struct deb_digest *digest, const void *buf, size_t len);
+void
+deb_digest_free(struct deb_digest *digest);
+
+int
+verifyDeb(struct debsig_ctx *ctx, struct deb_archive *deb,
+          const struct verify_opts *opts, struct debsig_result *res);
+void
+origin_cache_free(struct origin_policies *origins);
+void
+origin_policies_scan(struct origin_policies *op);
+void
+sig_types_free(struct debsig_ctx *ctx);
+
+bool
+policy_cache_load(struct debsig_ctx *ctx, struct origin_policies *op);
+struct policy *
+policy_cache_get(struct origin_policies *op, int i, bool selection_only);
+void
+policy_cache_unmap(struct origin_policies *op);
+int
+policy_cache_compile(struct debsig_ctx *ctx, const char *originID);
+int
+policy_cache_compile_all(struct debsig_ctx *ctx);
+int
+verifyPackage(struct debsig_ctx *ctx, const char *filename, int fd,
+              const struct verify_opts *opts, struct debsig_result *res);
+
+int
+daemonRun(struct debsig_ctx *ctx, const char *socket_path, int jobs);
+int
+daemonVerify(const char *socket_path, const char *filename,
+             const struct verify_opts *opts);
 
 /* Debugging and failures */
+#define DS_LEV_NONE 4
 #define DS_LEV_ALWAYS 3
 #define DS_LEV_ERR 2
 #define DS_LEV_INFO 1
 #define DS_LEV_VER 0
 #define DS_LEV_DEBUG -1
 
-#define DS_SUCCESS		0
-#define DS_FAIL_NOSIGS		10
-#define DS_FAIL_UNKNOWN_ORIGIN	11
-#define DS_FAIL_NOPOLICIES	12
-#define DS_FAIL_BADSIG		13
-#define DS_FAIL_INTERNAL	14
+#define DS_SUCCESS		DEBSIG_OK
+#define DS_FAIL_NOSIGS		DEBSIG_FAIL_NOSIGS
+#define DS_FAIL_UNKNOWN_ORIGIN	DEBSIG_FAIL_UNKNOWN_ORIGIN
+#define DS_FAIL_NOPOLICIES	DEBSIG_FAIL_NOPOLICIES
+#define DS_FAIL_BADSIG		DEBSIG_FAIL_BADSIG
+#define DS_FAIL_INTERNAL	DEBSIG_FAIL_INTERNAL
 void
 ds_printf(int level, const char *fmt, ...)
 	__attribute__ ((__format__ (__printf__, 2, 3)));
-#define ds_fail_printf(myexit, fmt, args...)	\
-do {						\
-	ds_printf(DS_LEV_ERR, fmt, ##args);	\
-	exit(myexit);				\
-} while(0)
 
 extern int ds_debug_level;
-extern const char *rootdir;
-extern const char *policies_dir;
-extern const char *keyrings_dir;
@@ -25,294 +25,981 @@
 #include <config.h>
 
 #include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <ftw.h>
 
 #include <dpkg/dpkg.h>
-#include <dpkg/subproc.h>
 #include <dpkg/command.h>
 #include <dpkg/buffer.h>
+#include <dpkg/fdio.h>
 #include <dpkg/path.h>
 
 #include "debsig.h"
 
-static int gpg_inited = 0;
-static char *gpg_tmpdir;
-static const char *gpg_prog = "gpg";
+static int
+gpg_tmpdir_remove_entry(const char *pathname, const struct stat *st,
+                        int type, struct FTW *ftw)
+{
+    if (remove(pathname) < 0 && errno != ENOENT)
+        ds_printf(DS_LEV_DEBUG, "gpg_tmpdir_remove: cannot remove %s: %s",
+                  pathname, strerror(errno));
 
-static void
-cleanup_gpg_tmpdir(void)
+    return 0;
+}
+
+/* Remove the temporary gpg home of the context, if this process is the
+ * one that created it, otherwise only forget about it. */
+void
+gpg_tmpdir_remove(struct debsig_ctx *ctx)
 {
-    pid_t pid;
+    if (ctx->gpg_tmpdir == NULL)
+        return;
 
-    pid = subproc_fork();
-    if (pid == 0) {
-      execlp("rm", "rm", "-rf", gpg_tmpdir, NULL);
-      ohshite("unable to execute %s (%s)", "rm", "rm -rf");
-    }
-    subproc_reap(pid, "getSigKeyID", SUBPROC_NOCHECK);
+    /* Walk it depth first, so that directories are empty by the time they
+     * get removed, and without following any symlink gpg left in there. */
+    if (ctx->gpg_tmpdir_pid == getpid())
+        nftw(ctx->gpg_tmpdir, gpg_tmpdir_remove_entry, 16,
+             FTW_DEPTH | FTW_PHYS);
 
-    free(gpg_tmpdir);
-    gpg_tmpdir = NULL;
-    gpg_inited = 0;
+    free(ctx->gpg_tmpdir);
+    ctx->gpg_tmpdir = NULL;
 }
 
-/* Ensure that gpg has a writable HOME to put its keyrings */
+/* Ensure that gpg has a writable home to put its keyrings. Each
+ * verification worker process gets its own, so that concurrent gpg runs do
+ * not fight over its lock files. It only ever gets passed with --homedir,
+ * so the environment of the process is left alone. */
 static void
-gpg_init(void)
+gpg_init(struct debsig_ctx *ctx)
 {
-    const char *prog;
     char *gpg_tmpdir_template;
-    int rc;
 
-    if (gpg_inited)
+    if (ctx->gpg_tmpdir && ctx->gpg_tmpdir_pid == getpid())
         return;
-
-    prog = getenv("DEBSIG_GNUPG_PROGRAM");
-    if (prog)
-      gpg_prog = prog;
+    gpg_tmpdir_remove(ctx);
 
     gpg_tmpdir_template = path_make_temp_template("debsig-verify");
-    gpg_tmpdir = mkdtemp(gpg_tmpdir_template);
-    if (gpg_tmpdir == NULL)
+    if (mkdtemp(gpg_tmpdir_template) == NULL)
         ohshite("cannot create temporary directory '%s'", gpg_tmpdir_template);
 
-    rc = setenv("GNUPGHOME", gpg_tmpdir, 1);
-    if (rc < 0)
-        ohshite("cannot set environment variable %s to '%s'", "GNUPGHOME",
-                gpg_tmpdir);
-
-    rc = atexit(cleanup_gpg_tmpdir);
-    if (rc != 0)
-       ohshit("cannot set atexit cleanup handler");
-
-    gpg_inited = 1;
+    ctx->gpg_tmpdir = gpg_tmpdir_template;
+    ctx->gpg_tmpdir_pid = getpid();
 }
 
 static void
 command_gpg_init(struct command *cmd)
 {
-    command_init(cmd, gpg_prog, "gpg");
-    command_add_args(cmd, "--no-options", "--no-default-keyring", "--batch",
+    const char *prog;
+
+    prog = getenv("DEBSIG_GNUPG_PROGRAM");
+    if (prog == NULL)
+      prog = "gpg";
+
+    command_init(cmd, prog, "gpg");
+    command_add_args(cmd, prog, "--no-options", "--no-default-keyring", "--batch",
                           "--no-secmem-warning", "--no-permission-warning",
                           "--no-mdc-warning", "--no-auto-check-trustdb", NULL);
 }
 
-enum keyid_state {
-    KEYID_UNKNOWN,
-    KEYID_USER,
-    KEYID_SIG,
+/* Point gpg at its home, explicitly, as it might get started by the
+ * launcher, which does not share our environment. That is either the
+ * temporary one of this process, or a prepared one which gpg must not
+ * write to. Without a trust database there, no trust model gets to use
+ * one. */
+static void
+command_gpg_home(struct debsig_ctx *ctx, struct command *cmd, const char *home)
+{
+    if (home == NULL) {
+        command_add_args(cmd, "--homedir", ctx->gpg_tmpdir, NULL);
+        return;
+    }
+
+    command_add_args(cmd, "--homedir", home, "--trust-model", "always",
+                          "--no-autostart", "--lock-never", NULL);
+}
+
+/* Split a line of gpg machine-readable output in place, on sep, into at
+ * most max fields. Returns the number of fields. */
+static int
+gpg_split(char *line, int sep, char **fields, int max)
+{
+    char *c;
+    int n = 0;
+
+    c = strchr(line, '\n');
+    if (c)
+	*c = '\0';
+
+    fields[n++] = line;
+    while (n < max && (c = strchr(line, sep)) != NULL) {
+	*c = '\0';
+	line = c + 1;
+	fields[n++] = line;
+    }
+
+    return n;
+}
+
+/* Undo the C-style escaping of --with-colons string fields, in place. */
+static void
+gpg_unescape(char *str)
+{
+    char *d = str;
+
+    while (*str) {
+	if (str[0] == '\\' && str[1] == 'x' &&
+	    isxdigit((unsigned char)str[2]) &&
+	    isxdigit((unsigned char)str[3])) {
+	    char hex[3] = { str[2], str[3], '\0' };
+
+	    *d++ = strtol(hex, NULL, 16);
+	    str += 4;
+	} else {
+	    *d++ = *str++;
+	}
+    }
+    *d = '\0';
+}
+
+/* Signatures that have expired, or that were made by a key which has
+ * expired or been revoked since, are good as far as gpg is concerned, but
+ * we do not accept them, as the native backend does not either. */
+enum gpg_sig_result {
+    GPG_SIG_NONE,
+    GPG_SIG_GOOD,
+    GPG_SIG_EXPIRED,
+    GPG_SIG_EXPIRED_KEY,
+    GPG_SIG_REVOKED_KEY,
+    GPG_SIG_BAD,
+    GPG_SIG_ERROR,
+};
+
+static const char *const gpg_sig_result_names[] = {
+    [GPG_SIG_NONE] = "unchecked",
+    [GPG_SIG_GOOD] = "good",
+    [GPG_SIG_EXPIRED] = "expired",
+    [GPG_SIG_EXPIRED_KEY] = "expired key",
+    [GPG_SIG_REVOKED_KEY] = "revoked key",
+    [GPG_SIG_BAD] = "bad",
+    [GPG_SIG_ERROR] = "unchecked",
+};
+
+/* What gpg reported about a signature on its --status-fd. */
+struct gpg_sig_status {
+    enum gpg_sig_result result;
+    bool valid;
+    char *keyid;
+    char *fpr;
+    time_t created;
 };
 
-char *
-getKeyID(const char *originID, const struct match *mtc)
+static void
+gpg_sig_status_set(char **field, const char *value)
 {
-    static char buf[2048];
-    char *keyring;
-    pid_t pid;
-    int pipefd[2];
-    FILE *ds;
-    char *c, *d, *ret = NULL;
-    enum keyid_state state = KEYID_UNKNOWN;
+    free(*field);
+    *field = m_strdup(value);
+}
 
-    if (mtc->id == NULL)
-	return NULL;
+/* Collect the issuer, fingerprint, timestamp and outcome of each signature
+ * from the status lines gpg writes while checking them, in the order they
+ * were found, for up to max signatures. Returns how many gpg found. */
+static int
+gpg_sig_status_read(FILE *fp, struct gpg_sig_status *sts, int max)
+{
+    struct gpg_sig_status *st = NULL;
+    char buf[2048];
+    char *f[12];
+    int n, nsigs = 0;
+
+    memset(sts, 0, max * sizeof(*sts));
+
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+	if (strncmp(buf, GPG_STATUS_PREFIX, strlen(GPG_STATUS_PREFIX)) != 0)
+	    continue;
+
+	n = gpg_split(buf + strlen(GPG_STATUS_PREFIX), ' ', f, 12);
+
+	if (strcmp(f[0], "NEWSIG") == 0) {
+	    st = nsigs < max ? &sts[nsigs] : NULL;
+	    nsigs++;
+	} else if (st == NULL) {
+	    continue;
+	} else if (strcmp(f[0], "GOODSIG") == 0 && n >= 2) {
+	    gpg_sig_status_set(&st->keyid, f[1]);
+	    if (st->result == GPG_SIG_NONE)
+		st->result = GPG_SIG_GOOD;
+	} else if (strcmp(f[0], "EXPSIG") == 0 && n >= 2) {
+	    gpg_sig_status_set(&st->keyid, f[1]);
+	    if (st->result < GPG_SIG_EXPIRED)
+		st->result = GPG_SIG_EXPIRED;
+	} else if (strcmp(f[0], "EXPKEYSIG") == 0 && n >= 2) {
+	    gpg_sig_status_set(&st->keyid, f[1]);
+	    if (st->result < GPG_SIG_EXPIRED_KEY)
+		st->result = GPG_SIG_EXPIRED_KEY;
+	} else if (strcmp(f[0], "REVKEYSIG") == 0 && n >= 2) {
+	    gpg_sig_status_set(&st->keyid, f[1]);
+	    if (st->result < GPG_SIG_REVOKED_KEY)
+		st->result = GPG_SIG_REVOKED_KEY;
+	} else if (strcmp(f[0], "BADSIG") == 0 && n >= 2) {
+	    gpg_sig_status_set(&st->keyid, f[1]);
+	    st->result = GPG_SIG_BAD;
+	} else if (strcmp(f[0], "ERRSIG") == 0 && n >= 7) {
+	    /* ERRSIG <keyid> <pkalgo> <hashalgo> <class> <time> <rc> [<fpr>] */
+	    gpg_sig_status_set(&st->keyid, f[1]);
+	    st->created = strtoll(f[5], NULL, 10);
+	    if (n >= 8 && strcmp(f[7], "-") != 0)
+		gpg_sig_status_set(&st->fpr, f[7]);
+	    st->result = GPG_SIG_ERROR;
+	} else if (strcmp(f[0], "VALIDSIG") == 0 && n >= 4) {
+	    /* VALIDSIG <fpr> <date> <time> ... */
+	    gpg_sig_status_set(&st->fpr, f[1]);
+	    st->created = strtoll(f[3], NULL, 10);
+	    st->valid = true;
+	}
+    }
+    if (ferror(fp))
+	ohshit("error reading from gpg");
+
+    return nsigs;
+}
 
-    gpg_init();
+static void
+gpg_sig_status_destroy(struct gpg_sig_status *st)
+{
+    free(st->keyid);
+    free(st->fpr);
+}
 
-    m_asprintf(&keyring, "%s%s/%s/%s", rootdir, keyrings_dir, originID,
-               mtc->file);
+/* Copy a keyring already in the keybox format, which gpg cannot import
+ * from, as is. Returns 1 if copied, 0 if not a keybox, or -1 on error. */
+static int
+gpg_keybox_copy(const char *keyring, const char *kbx)
+{
+    struct dpkg_error err;
+    char magic[12];
+    int fd_in, fd_out;
+    int rc = -1;
+
+    fd_in = open(keyring, O_RDONLY | O_CLOEXEC);
+    if (fd_in < 0)
+	return -1;
+    if (fd_read(fd_in, magic, sizeof(magic)) != sizeof(magic) ||
+        memcmp(magic + 8, "KBXf", 4) != 0) {
+	close(fd_in);
+	return 0;
+    }
+    if (lseek(fd_in, 0, SEEK_SET) < 0) {
+	close(fd_in);
+	return -1;
+    }
 
-    m_pipe(pipefd);
-    pid = subproc_fork();
-    if (pid == 0) {
-        struct command cmd;
+    fd_out = open(kbx, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd_out >= 0) {
+	if (fd_fd_copy(fd_in, fd_out, -1, &err) < 0) {
+	    ds_printf(DS_LEV_DEBUG, "gpg_keybox_copy: %s", err.str);
+	    dpkg_error_destroy(&err);
+	} else {
+	    rc = 1;
+	}
+	if (close(fd_out) < 0)
+	    rc = -1;
+    }
+    close(fd_in);
 
-        m_dup2(pipefd[1], STDOUT_FILENO);
-        close(pipefd[0]);
-        close(pipefd[1]);
+    return rc;
+}
 
-        command_gpg_init(&cmd);
-        command_add_args(&cmd, "--list-packets", "-q", keyring, NULL);
-        command_exec(&cmd);
+/* The identity of the keyring a prepared keybox got made from, and the
+ * inode of the keybox itself, as recorded in a stamp file next to it. The
+ * keybox inode ties the stamp to the keybox it was written for, in case
+ * another process replaced either meanwhile. */
+struct gpg_home_stamp {
+    uintmax_t dev;
+    uintmax_t ino;
+    intmax_t size;
+    intmax_t mtime_sec;
+    intmax_t mtime_nsec;
+    uintmax_t kbx_ino;
+};
+
+static void
+gpg_home_stamp_init(struct gpg_home_stamp *stamp, const struct stat *src,
+                    ino_t kbx_ino)
+{
+    stamp->dev = src->st_dev;
+    stamp->ino = src->st_ino;
+    stamp->size = src->st_size;
+    stamp->mtime_sec = src->st_mtim.tv_sec;
+    stamp->mtime_nsec = src->st_mtim.tv_nsec;
+    stamp->kbx_ino = kbx_ino;
+}
+
+static bool
+gpg_home_stamp_equal(const struct gpg_home_stamp *a,
+                     const struct gpg_home_stamp *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+           a->kbx_ino == b->kbx_ino;
+}
+
+static bool
+gpg_home_stamp_read(const char *path, struct gpg_home_stamp *stamp)
+{
+    struct stat st;
+    FILE *fp;
+    int fd, n;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+	return false;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        !ds_cache_trusted(path, &st) || (fp = fdopen(fd, "r")) == NULL) {
+	close(fd);
+	return false;
     }
-    close(pipefd[1]);
+    n = fscanf(fp, "%ju %ju %jd %jd %jd %ju", &stamp->dev, &stamp->ino,
+               &stamp->size, &stamp->mtime_sec, &stamp->mtime_nsec,
+               &stamp->kbx_ino);
+    fclose(fp);
 
-    free(keyring);
+    return n == 6;
+}
 
-    ds = fdopen(pipefd[0], "r");
-    if (ds == NULL) {
-	perror("gpg");
+static int
+gpg_home_stamp_write(const char *path, const struct gpg_home_stamp *stamp)
+{
+    char *tmp;
+    FILE *fp;
+    int fd, rc;
+
+    m_asprintf(&tmp, "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+	free(tmp);
+	return -1;
+    }
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+	close(fd);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+    }
+    fprintf(fp, "%ju %ju %jd %jd %jd %ju\n", stamp->dev, stamp->ino,
+            stamp->size, stamp->mtime_sec, stamp->mtime_nsec, stamp->kbx_ino);
+    rc = fclose(fp) == 0 && rename(tmp, path) == 0 ? 0 : -1;
+    if (rc < 0)
+	unlink(tmp);
+    free(tmp);
+
+    return rc;
+}
+
+/* Create a directory of the prepared gpg homes, with the permissions it
+ * needs to be trusted whatever the umask. */
+static int
+gpg_home_mkdir(const char *path)
+{
+    if (mkdir(path, 0755) < 0)
+	return errno == EEXIST ? 0 : -1;
+
+    return chmod(path, 0755);
+}
+
+/* Whether a directory or file of the prepared gpg homes is what it should
+ * be, and can be trusted. */
+static bool
+gpg_home_path_trusted(const char *path, mode_t type)
+{
+    struct stat st;
+
+    if (lstat(path, &st) < 0 || (st.st_mode & S_IFMT) != type)
+	return false;
+
+    return ds_cache_trusted(path, &st);
+}
+
+/* Get the keyring gpg should use for a keyring file of an origin, out of
+ * the prepared gpg home of the origin in the cache directory, where it is
+ * kept converted to the keybox format gpg reads fastest. The keybox is
+ * only used while the keyring it was made from, src, is the one its stamp
+ * file records, and while nobody but root or us can have written to them
+ * or to their directories. Returns NULL if no prepared keybox can be used,
+ * otherwise its pathname, along with the gpg home in home. */
+static char *
+gpg_home_keyring(struct debsig_ctx *ctx, const char *originID,
+                 const char *file, const char *keyring,
+                 const struct stat *src, char **home)
+{
+    struct gpg_home_stamp want, have;
+    struct stat st;
+    struct command cmd;
+    struct gpg_proc proc;
+    char *cache, *homes, *dir, *kbx, *stamp, *tmp, *backup;
+    int rc;
+
+    m_asprintf(&cache, "%s%s", ctx->rootdir, ctx->cache_dir);
+    m_asprintf(&homes, "%s/gnupg", cache);
+    m_asprintf(&dir, "%s/%s", homes, originID);
+    m_asprintf(&kbx, "%s/%s.kbx", dir, file);
+    m_asprintf(&stamp, "%s/%s.stamp", dir, file);
+
+    gpg_home_stamp_init(&want, src, 0);
+
+    if (gpg_home_path_trusted(cache, S_IFDIR) &&
+        gpg_home_path_trusted(homes, S_IFDIR) &&
+        gpg_home_path_trusted(dir, S_IFDIR) &&
+        lstat(kbx, &st) == 0 && S_ISREG(st.st_mode) &&
+        ds_cache_trusted(kbx, &st) &&
+        gpg_home_stamp_read(stamp, &have)) {
+	want.kbx_ino = st.st_ino;
+	if (gpg_home_stamp_equal(&want, &have)) {
+	    free(cache);
+	    free(homes);
+	    free(stamp);
+	    *home = dir;
+	    return kbx;
+	}
+    }
+
+    ds_printf(DS_LEV_DEBUG, "gpg_home_keyring: preparing %s", kbx);
+
+    if (gpg_home_mkdir(cache) < 0 || gpg_home_mkdir(homes) < 0 ||
+        gpg_home_mkdir(dir) < 0 ||
+        !gpg_home_path_trusted(cache, S_IFDIR) ||
+        !gpg_home_path_trusted(homes, S_IFDIR) ||
+        !gpg_home_path_trusted(dir, S_IFDIR)) {
+	ds_printf(DS_LEV_DEBUG, "gpg_home_keyring: cannot use %s", dir);
+	free(cache);
+	free(homes);
+	free(dir);
+	free(kbx);
+	free(stamp);
 	return NULL;
     }
+    free(cache);
+    free(homes);
+
+    /* The keybox gets made under a temporary name, and only then moved
+     * into place, before its stamp. */
+    m_asprintf(&tmp, "%s/.%s.%d.kbx", dir, file, (int)getpid());
+    m_asprintf(&backup, "%s~", tmp);
+
+    switch (gpg_keybox_copy(keyring, tmp)) {
+    case 1:
+	rc = 0;
+	break;
+    case 0:
+	/* Importing uses the temporary gpg home of this process. */
+	gpg_init(ctx);
 
-    while (fgets(buf, sizeof(buf), ds) != NULL) {
-	/* Skip comments. */
-	if (buf[0] == '#')
-	    continue;
+	command_gpg_init(&cmd);
+	command_gpg_home(ctx, &cmd, NULL);
+	command_add_args(&cmd, "--no-autostart", "--lock-never",
+	                 "--keyring", tmp, "--import", keyring, NULL);
+	gpg_spawn(&proc, &cmd, -1, -1);
+	command_destroy(&cmd);
+	rc = gpg_wait(&proc, "gpg_home_keyring");
+	break;
+    default:
+	rc = -1;
+	break;
+    }
 
-	if (state == KEYID_UNKNOWN) {
-	    if (strncmp(buf, USER_MAGIC, strlen(USER_MAGIC)) != 0)
-		continue;
-	    c = strchr(buf, '"');
-	    if (c == NULL)
-		continue;
-	    d = c + 1;
-	    c = strchr(d, '"');
-	    if (c == NULL)
-		continue;
-	    *c = '\0';
-	    if (strcmp(d, mtc->id) != 0)
-		continue;
-	    /* User match found. */
-	    state = KEYID_USER;
-	} else if (state == KEYID_USER) {
-	    if (strncmp(buf, SIG_MAGIC, strlen(SIG_MAGIC)) != 0)
-		continue;
-	    if ((c = strchr(buf, '\n')) != NULL)
-		*c = '\0';
-	    d = strstr(buf, "keyid");
-	    if (d) {
-		ret = d + 6;
-		/* Keyid match found. */
+    if (rc != 0 || chmod(tmp, 0644) < 0 || lstat(tmp, &st) < 0 ||
+        rename(tmp, kbx) < 0) {
+	ds_printf(DS_LEV_DEBUG, "gpg_home_keyring: cannot prepare %s", kbx);
+	unlink(tmp);
+	unlink(backup);
+	free(tmp);
+	free(backup);
+	free(dir);
+	free(kbx);
+	free(stamp);
+	return NULL;
+    }
+    unlink(backup);
+    free(tmp);
+    free(backup);
+
+    /* Without its stamp the keybox is only good for this time. */
+    want.kbx_ino = st.st_ino;
+    if (gpg_home_stamp_write(stamp, &want) < 0)
+	ds_printf(DS_LEV_DEBUG, "gpg_home_keyring: cannot write %s: %s",
+	          stamp, strerror(errno));
+    free(stamp);
+
+    *home = dir;
+    return kbx;
+}
+
+/* Ask gpg to map a user ID to a key ID, for keyrings our own reader does
+ * not know about. The key ID is the one of the primary key that carries
+ * the user ID. */
+static char *
+gpgKeyID(struct debsig_ctx *ctx, const char *originID,
+         const struct keyring *kr, const struct match *mtc)
+{
+    char buf[2048];
+    struct command cmd;
+    struct gpg_proc proc;
+    int pipefd[2];
+    FILE *ds;
+    char *f[12];
+    char *keyid = NULL, *ret = NULL;
+    char *keyring = NULL, *home = NULL;
+    int n;
+
+    if (ctx->gpg_cache) {
+	struct stat src;
+
+	/* The identity of the keyring as it was loaded. */
+	memset(&src, 0, sizeof(src));
+	src.st_dev = kr->dev;
+	src.st_ino = kr->ino;
+	src.st_size = kr->size;
+	src.st_mtim = kr->mtime;
+	keyring = gpg_home_keyring(ctx, originID, mtc->file, kr->path,
+	                           &src, &home);
+    }
+    if (keyring == NULL) {
+	gpg_init(ctx);
+	keyring = m_strdup(kr->path);
+    }
+
+    gpg_pipe(pipefd);
+
+    command_gpg_init(&cmd);
+    command_gpg_home(ctx, &cmd, home);
+    command_add_args(&cmd, "--with-colons", "--fixed-list-mode",
+                     "--keyring", keyring, "--list-keys", NULL);
+    gpg_spawn(&proc, &cmd, -1, pipefd[1]);
+    command_destroy(&cmd);
+    close(pipefd[1]);
+    free(keyring);
+    free(home);
+
+    ds = fdopen(pipefd[0], "r");
+    if (ds == NULL)
+	ohshite("error opening file stream for gpg");
+
+    while (fgets(buf, sizeof(buf), ds) != NULL) {
+	n = gpg_split(buf, ':', f, 12);
+
+	if (strcmp(f[0], "pub") == 0) {
+	    free(keyid);
+	    keyid = n >= 5 ? m_strdup(f[4]) : NULL;
+	} else if (strcmp(f[0], "uid") == 0 && n >= 10 && keyid) {
+	    gpg_unescape(f[9]);
+	    if (strcmp(f[9], mtc->id) == 0) {
+		ret = keyid;
+		keyid = NULL;
 		break;
 	    }
-	    /* Reset state. */
-	    state = KEYID_UNKNOWN;
 	}
     }
+    free(keyid);
     fclose(ds);
 
-    subproc_reap(pid, "getKeyID", SUBPROC_NORMAL);
+    gpg_wait(&proc, "getKeyID");
+
+    return ret;
+}
+
+/* Map the user ID of a match to a key ID. The resolution is remembered
+ * along with the keyring, so that later policies, groups and packages
+ * sharing it get the answer without a lookup or a gpg run. */
+const char *
+getKeyID(struct debsig_ctx *ctx, const char *originID,
+         const struct match *mtc)
+{
+    struct keyring *kr;
+    const struct keyring_uid *ku;
+    char *keyring;
+    time_t now;
+    int status;
+
+    if (mtc->id == NULL)
+	return NULL;
 
-    if (ret == NULL) {
+    keyring = ds_keyring_path(ctx, originID, mtc->file);
+    kr = keyring_get(ctx, keyring, &status);
+    free(keyring);
+    if (kr == NULL) {
+	ds_printf(DS_LEV_DEBUG, "        getKeyID: no keyring, falling back to %s", mtc->id);
+	return mtc->id;
+    }
+
+    now = time(NULL);
+    ku = keyring_uid_get(kr, mtc->id, now);
+    if (ku == NULL) {
+	const struct key_uid *uid = NULL;
+	char *ret;
+
+	if (status == PGP_OK)
+	    uid = keyring_find_uid(kr, mtc->id, now);
+
+	if (status == PGP_ERR_UNSUPPORTED || (uid && uid->key->unchecked)) {
+	    ds_printf(DS_LEV_DEBUG, "        getKeyID: cannot use keyring %s natively, asking gpg",
+	              kr->path);
+	    ret = gpgKeyID(ctx, originID, kr, mtc);
+	    ku = keyring_uid_put(kr, mtc->id, ret, 0);
+	    free(ret);
+	} else if (uid) {
+	    ku = keyring_uid_put(kr, mtc->id, uid->key->keyid_str,
+	                         uid->expires);
+	} else {
+	    ku = keyring_uid_put(kr, mtc->id, NULL, 0);
+	}
+    }
+
+    if (ku->keyid == NULL) {
 	ds_printf(DS_LEV_DEBUG, "        getKeyID: no match, falling back to %s", mtc->id);
-	ret = mtc->id;
-    } else {
-	ds_printf(DS_LEV_DEBUG, "        getKeyID: mapped %s -> %s", mtc->id, ret);
+	return mtc->id;
     }
 
-    return ret;
+    ds_printf(DS_LEV_DEBUG, "        getKeyID: mapped %s -> %s", mtc->id, ku->keyid);
+
+    return ku->keyid;
 }
 
-char *
-getSigKeyID(struct dpkg_ar *deb, const char *type)
+/* Ask gpg for the key IDs of signatures whose packets our own parser does
+ * not know about. Without any keyring gpg cannot check them, but still
+ * reports their issuers on the status output. The signature members all
+ * get fed to a single gpg as one stream of detached signatures, which it
+ * reports on in order. If it does not find as many signatures as members,
+ * they cannot be told apart and none gets resolved. Returns whether the
+ * key IDs could be told. */
+static bool
+gpgSigKeyIDs(struct debsig_ctx *ctx, struct deb_archive *deb,
+             struct deb_sig **sigs, int nsigs)
 {
-    static char buf[2048];
+    struct gpg_sig_status *sts;
     struct dpkg_error err;
+    struct gpg_sigpipe sp;
+    struct command cmd;
+    struct gpg_proc proc;
     int pread[2], pwrite[2];
-    off_t len = checkSigExist(deb, type);
-    pid_t pid;
     FILE *ds_read;
-    char *c, *ret = NULL;
-
-    if (!len)
-	return NULL;
+    bool fed = true;
+    int found, i;
 
-    gpg_init();
+    gpg_init(ctx);
 
-    /* Fork for gpg, keeping a nice pipe to read/write from.  */
-    if (pipe(pread) < 0)
-        ohshite("error creating a pipe");
-    if (pipe(pwrite) < 0)
-        ohshite("error creating a pipe");
-    /* I like file streams, so sue me :P */
+    gpg_pipe(pread);
+    gpg_pipe(pwrite);
     if ((ds_read = fdopen(pread[0], "r")) == NULL)
 	ohshite("error opening file stream for gpg");
 
-    pid = subproc_fork();
-    if (pid == 0) {
-        struct command cmd;
+    command_gpg_init(&cmd);
+    command_gpg_home(ctx, &cmd, NULL);
+    command_add_args(&cmd, "--status-fd", "1", "--verify", "-", "/dev/null",
+                     NULL);
+    gpg_spawn(&proc, &cmd, pwrite[0], pread[1]);
+    command_destroy(&cmd);
+    close(pread[1]); close(pwrite[0]);
 
-	/* Here we go */
-	m_dup2(pread[1], 1);
-	close(pread[0]);
-	close(pread[1]);
-	m_dup2(pwrite[0], 0);
-	close(pwrite[0]);
-	close(pwrite[1]);
+    /* gpg gives up on the first signature it cannot make sense of, so we
+     * might get EPIPE for the following ones. */
+    gpg_sigpipe_block(&sp);
 
-	command_gpg_init(&cmd);
-	command_add_args(&cmd, "--list-packets", "-q", "-", NULL);
-	command_exec(&cmd);
+    for (i = 0; i < nsigs && fed; i++) {
+	if (copyMember(deb, sigs[i]->mem, pwrite[1], &err) < 0) {
+	    ds_printf(DS_LEV_DEBUG, "getSigKeyID: cannot feed %s to gpg: %s",
+	              sigs[i]->mem->name, err.str);
+	    dpkg_error_destroy(&err);
+	    fed = false;
+	}
     }
-    close(pread[1]); close(pwrite[0]);
 
-    /* First, let's feed gpg our signature. Don't forget, our call to
-     * checkSigExist() above positioned the deb->fd file pointer already.  */
-    if (fd_fd_copy(deb->fd, pwrite[1], len, &err) < 0)
-	ohshit("getSigKeyID: error reading signature (%s)", err.str);
+    gpg_sigpipe_restore(&sp);
 
-    if (close(pwrite[1]) < 0)
+    if (close(pwrite[1]) < 0 && fed)
 	ohshite("getSigKeyID: error closing gpg write pipe");
 
-    /* Now, let's see what gpg has to say about all this */
-    while (fgets(buf, sizeof(buf), ds_read) != NULL) {
-	if (strncmp(buf, SIG_MAGIC, strlen(SIG_MAGIC)) == 0) {
-	    if ((c = strchr(buf, '\n')) != NULL)
-		*c = '\0';
-	    /* This is the only line we care about */
-	    ret = strstr(buf, "keyid");
-	    if (ret) {
-		ret += 6;
-		break;
+    sts = m_malloc(nsigs * sizeof(*sts));
+    found = gpg_sig_status_read(ds_read, sts, nsigs);
+    fclose(ds_read);
+
+    gpg_wait(&proc, "getSigKeyID");
+
+    if (fed && found == nsigs) {
+	for (i = 0; i < nsigs; i++) {
+	    sigs[i]->keyid = sts[i].keyid;
+	    sigs[i]->keyid_done = true;
+	    sts[i].keyid = NULL;
+	}
+    } else {
+	ds_printf(DS_LEV_DEBUG, "getSigKeyID: gpg found %d signatures in %d members",
+	          found, nsigs);
+    }
+
+    for (i = 0; i < nsigs; i++)
+	gpg_sig_status_destroy(&sts[i]);
+    free(sts);
+
+    return fed && found == nsigs;
+}
+
+/* Parse all the signature members of a package, once, so that every later
+ * lookup of their key ID or contents comes from this table. */
+static void
+deb_sigs_load(struct deb_archive *deb)
+{
+    struct dpkg_error err;
+    const void *data;
+    int i;
+
+    deb->sigs_loaded = true;
+
+    for (i = 0; i < deb->nmembers; i++) {
+	const struct ar_member *mem = &deb->members[i];
+	struct deb_sig *ds;
+
+	if (strncmp(mem->name, "_gpg", 4) != 0 || mem->size == 0)
+	    continue;
+
+	deb->sigs = m_realloc(deb->sigs, (deb->nsigs + 1) * sizeof(*ds));
+	ds = &deb->sigs[deb->nsigs++];
+	memset(ds, 0, sizeof(*ds));
+	ds->mem = mem;
+
+	if (mem->size > SIG_MAX_SIZE) {
+	    ds_printf(DS_LEV_DEBUG, "deb_sigs_load: %s signature is too large",
+	              mem->name);
+	    ds->status = PGP_ERR_MALFORMED;
+	    ds->keyid_done = true;
+	    continue;
+	}
+
+	data = readMember(deb, mem, &err);
+	if (data == NULL)
+	    ohshit("deb_sigs_load: error reading signature (%s)", err.str);
+
+	ds->status = pgp_parse_sig(data, mem->size, &ds->sig);
+	if (ds->status == PGP_OK) {
+	    if (ds->sig.has_keyid) {
+		char buf[17];
+
+		pgp_keyid_str(ds->sig.keyid, buf);
+		ds->keyid = m_strdup(buf);
 	    }
+	    ds->keyid_done = true;
+	    ds_printf(DS_LEV_DEBUG, "deb_sigs_load: %s from %s, created %jd, "
+	              "algorithm %d, hash %d", mem->name,
+	              ds->keyid ? ds->keyid : "unknown key",
+	              (intmax_t)ds->sig.created, ds->sig.pubkey_algo,
+	              ds->sig.hash_algo);
+	} else if (ds->status != PGP_ERR_UNSUPPORTED) {
+	    ds_printf(DS_LEV_DEBUG, "deb_sigs_load: cannot parse %s", mem->name);
+	    ds->keyid_done = true;
 	}
     }
-    if (ferror(ds_read))
-	ohshit("error reading from gpg");
-    fclose(ds_read);
+}
+
+void
+deb_sigs_free(struct deb_archive *deb)
+{
+    int i;
+
+    for (i = 0; i < deb->nsigs; i++) {
+	if (deb->sigs[i].status == PGP_OK)
+	    pgp_sig_destroy(&deb->sigs[i].sig);
+	free(deb->sigs[i].keyid);
+    }
+    free(deb->sigs);
+}
+
+/* Ask gpg, once, for the key IDs of all the signature members of a package
+ * our parser could not get, so that a single gpg run serves them all. */
+static void
+deb_sigs_gpg_ask(struct debsig_ctx *ctx, struct deb_archive *deb)
+{
+    struct deb_sig **pending;
+    int npending = 0;
+    int i;
+
+    deb->sigs_gpg_asked = true;
+
+    pending = m_malloc(deb->nsigs * sizeof(*pending));
+    for (i = 0; i < deb->nsigs; i++)
+	if (!deb->sigs[i].keyid_done)
+	    pending[npending++] = &deb->sigs[i];
+
+    if (npending > 0)
+	gpgSigKeyIDs(ctx, deb, pending, npending);
+
+    free(pending);
+}
+
+/* Get the parsed signature table entry of a signature member. */
+struct deb_sig *
+getSig(struct deb_archive *deb, const struct ar_member *mem)
+{
+    int i;
+
+    if (!deb->sigs_loaded)
+	deb_sigs_load(deb);
+
+    for (i = 0; i < deb->nsigs; i++)
+	if (deb->sigs[i].mem == mem)
+	    return &deb->sigs[i];
 
-    subproc_reap(pid, "getSigKeyID", SUBPROC_NOCHECK);
+    return NULL;
+}
+
+/* Get the key ID of a signature member, which stays valid until the
+ * package gets closed. Signature packets our parser does not know about
+ * get handed to gpg, once. */
+const char *
+getSigKeyID(struct debsig_ctx *ctx, struct deb_archive *deb,
+            const char *type)
+{
+    const struct ar_member *mem = checkSigExist(deb, type);
+    struct deb_sig *ds;
+
+    if (mem == NULL)
+	return NULL;
+
+    ds = getSig(deb, mem);
+    if (ds == NULL)
+	return NULL;
 
-    if (ret == NULL)
+    if (!ds->keyid_done && !deb->sigs_gpg_asked) {
+	ds_printf(DS_LEV_DEBUG, "        getSigKeyID: unsupported %s signature packet, asking gpg",
+	          type);
+	deb_sigs_gpg_ask(ctx, deb);
+    }
+    if (!ds->keyid_done) {
+	/* The members could not be told apart, ask for this one alone. */
+	gpgSigKeyIDs(ctx, deb, &ds, 1);
+	ds->keyid_done = true;
+    }
+
+    if (ds->keyid == NULL)
 	ds_printf(DS_LEV_DEBUG, "        getSigKeyID: failed for %s", type);
     else
-	ds_printf(DS_LEV_DEBUG, "        getSigKeyID: got %s for %s key", ret, type);
+	ds_printf(DS_LEV_DEBUG, "        getSigKeyID: got %s for %s key",
+	          ds->keyid, type);
 
-    return ret;
+    return ds->keyid;
 }
 
+/* Check a signature with gpg, which streams its outcome on the status
+ * output. The signature is only taken as valid when gpg vouches for it
+ * there, and not just through its exit status. The issuer gets recorded
+ * for the signature, if it was not known yet. */
 int
-gpgVerify(const char *originID, struct match *mtc,
-          const char *data, const char *sig)
+gpgVerify(struct debsig_ctx *ctx, const char *originID, struct match *mtc,
+          struct deb_archive *deb, const struct ar_member *mem,
+          const char *sig)
 {
-    char keyring[8192];
-    pid_t pid;
-    int rc;
-    struct stat st;
-
-    gpg_init();
-
-    snprintf(keyring, sizeof(keyring) - 1, "%s%s/%s/%s",
-             rootdir, keyrings_dir, originID, mtc->file);
-    if (stat(keyring, &st)) {
+    struct gpg_sig_status st;
+    struct deb_sig *ds;
+    char *keyring;
+    struct dpkg_error err;
+    struct gpg_sigpipe sp;
+    struct command cmd;
+    struct gpg_proc proc;
+    int pdata[2], pstatus[2];
+    FILE *status;
+    int rc, nsigs;
+    off_t len;
+    struct stat st_kr;
+    char *home = NULL;
+
+    keyring = ds_keyring_path(ctx, originID, mtc->file);
+    if (stat(keyring, &st_kr)) {
 	ds_printf(DS_LEV_DEBUG, "gpgVerify: could not stat %s", keyring);
+	free(keyring);
 	return 0;
     }
 
-    pid = subproc_fork();
-    if (pid == 0) {
-        struct command cmd;
+    if (ctx->gpg_cache) {
+	char *kbx;
 
-	if (DS_LEV_DEBUG < ds_debug_level) {
-	    close(0); close(1); close(2);
+	kbx = gpg_home_keyring(ctx, originID, mtc->file, keyring,
+	                       &st_kr, &home);
+	if (kbx) {
+	    free(keyring);
+	    keyring = kbx;
 	}
+    }
+    if (home == NULL)
+	gpg_init(ctx);
+
+    /* The signed data gets streamed to gpg through a pipe, directly from
+     * the package members, instead of going through a temporary file. */
+    gpg_pipe(pdata);
+    gpg_pipe(pstatus);
+    if ((status = fdopen(pstatus[0], "r")) == NULL)
+	ohshite("error opening file stream for gpg");
+
+    command_gpg_init(&cmd);
+    command_gpg_home(ctx, &cmd, home);
+    command_add_args(&cmd, "--status-fd", "1", "--keyring", keyring,
+                     "--verify", sig, "-", NULL);
+    gpg_spawn(&proc, &cmd, pdata[0], pstatus[1]);
+    command_destroy(&cmd);
+    close(pdata[0]);
+    close(pstatus[1]);
+    free(keyring);
+    free(home);
+
+    /* If gpg bails out early we get EPIPE instead of being killed, and
+     * let its status output decide the outcome. */
+    gpg_sigpipe_block(&sp);
+
+    /* The few status lines gpg emits before the data has been consumed
+     * fit in the pipe, so they can wait until all of it has been fed. */
+    len = copySignedData(deb, pdata[1], &err);
+    if (len < 0) {
+	ds_printf(DS_LEV_DEBUG, "gpgVerify: cannot feed signed data to gpg: %s",
+	          err.str);
+	dpkg_error_destroy(&err);
+    }
+
+    gpg_sigpipe_restore(&sp);
+
+    if (close(pdata[1]) < 0 && len >= 0)
+	ohshite("gpgVerify: error closing gpg data pipe");
+
+    nsigs = gpg_sig_status_read(status, &st, 1);
+    fclose(status);
 
-        command_gpg_init(&cmd);
-        command_add_args(&cmd, "--keyring", keyring, "--verify", sig, data, NULL);
-        command_exec(&cmd);
+    rc = gpg_wait(&proc, "gpgVerify");
+
+    ds_printf(DS_LEV_DEBUG, "gpgVerify: %s signature from %s (%s), made %jd",
+              gpg_sig_result_names[st.result], st.keyid ? st.keyid : "unknown key",
+              st.fpr ? st.fpr : "no fingerprint", (intmax_t)st.created);
+
+    ds = getSig(deb, mem);
+    if (ds && !ds->keyid_done && st.keyid) {
+	ds->keyid = st.keyid;
+	ds->keyid_done = true;
+	st.keyid = NULL;
     }
 
-    rc = subproc_reap(pid, "gpgVerify", SUBPROC_RETERROR | SUBPROC_RETSIGNO);
-    if (rc != 0) {
-	ds_printf(DS_LEV_DEBUG, "gpgVerify: gpg exited abnormally or with non-zero exit status");
+    if (rc != 0 || len < 0 || nsigs != 1 ||
+        st.result != GPG_SIG_GOOD || !st.valid) {
+	ds_printf(DS_LEV_DEBUG, "gpgVerify: gpg did not report a single valid signature");
+	gpg_sig_status_destroy(&st);
 	return 0;
     }
 
+    gpg_sig_status_destroy(&st);
+
     return 1;
 }
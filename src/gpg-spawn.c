@@ -0,0 +1,562 @@
+/*
+ * debsig-verify - Debian package signature verification tool
+ *
+ * Copyright © 2026 Guillem Jover <guillem@debian.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * starting gpg, directly or through the launcher co-process
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <dpkg/dpkg.h>
+#include <dpkg/fdio.h>
+#include <dpkg/subproc.h>
+#include <dpkg/command.h>
+
+#include "debsig.h"
+
+/* A request carries the program pathname and its arguments, each NUL
+ * terminated, along with the standard input, output and error for it, and
+ * the socket to send its wait status back on. */
+#define LAUNCHER_MSG_MAX 16384
+#define LAUNCHER_NFDS 4
+
+extern char **environ;
+
+/* Our end of the socket to the launcher, if there is one. */
+static int launcher_fd = -1;
+/* Whether the launcher is to be started on the first gpg run. */
+static bool launcher_deferred;
+
+static int launcher_wake[2];
+
+static void
+launcher_sigchld(int signo)
+{
+    int saved_errno = errno;
+
+    if (write(launcher_wake[1], "", 1) < 0) {
+	/* The pipe is full, so a wake up is pending anyway. */
+    }
+    errno = saved_errno;
+}
+
+struct launch {
+    struct launch *next;
+    pid_t pid;
+    int reply_fd;
+};
+
+/* Receive a request. Returns its length, 0 if nobody can send any more,
+ * or -1 for a bogus one. */
+static int
+launcher_recv(int sock, char *buf, int *fds)
+{
+    union {
+	char buf[CMSG_SPACE(LAUNCHER_NFDS * sizeof(int))];
+	struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t r;
+    int i;
+
+    for (i = 0; i < LAUNCHER_NFDS; i++)
+	fds[i] = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = LAUNCHER_MSG_MAX;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+	r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (r < 0 && errno == EINTR);
+    if (r <= 0)
+	return 0;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(LAUNCHER_NFDS * sizeof(int)))
+	    continue;
+	memcpy(fds, CMSG_DATA(cmsg), LAUNCHER_NFDS * sizeof(int));
+    }
+
+    if (fds[LAUNCHER_NFDS - 1] < 0 || buf[r - 1] != '\0' ||
+        (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+	for (i = 0; i < LAUNCHER_NFDS; i++)
+	    if (fds[i] >= 0)
+		close(fds[i]);
+	return -1;
+    }
+
+    return r;
+}
+
+/* Start a program with fds as its standard input, output and error. It
+ * gets spawned instead of forked, so that our address space does not get
+ * copied just to be thrown away by the exec. Returns its pid, or -1 with
+ * errno set. */
+static pid_t
+spawn_program(const char *filename, char *const argv[], const int *fds)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault;
+    pid_t pid;
+    int i, rc;
+
+    rc = posix_spawn_file_actions_init(&actions);
+    if (rc != 0) {
+	errno = rc;
+	return -1;
+    }
+    for (i = 0; i < 3 && rc == 0; i++)
+	rc = posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+    if (rc != 0) {
+	posix_spawn_file_actions_destroy(&actions);
+	errno = rc;
+	return -1;
+    }
+
+    /* We might be ignoring SIGPIPE, but the program should not. */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    rc = posix_spawnp(&pid, filename, &actions, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (rc != 0) {
+	errno = rc;
+	return -1;
+    }
+
+    return pid;
+}
+
+/* Start a program for a request, as a child of the launcher. */
+static pid_t
+launcher_exec(char *buf, ssize_t len, const int *fds)
+{
+    char *argv[256];
+    const char *filename = buf;
+    char *c = buf + strlen(buf) + 1;
+    int argc = 0;
+    pid_t pid;
+
+    while (c < buf + len && argc < 255) {
+	argv[argc++] = c;
+	c += strlen(c) + 1;
+    }
+    argv[argc] = NULL;
+    if (argc == 0 || c < buf + len)
+	return -1;
+
+    pid = spawn_program(filename, argv, fds);
+    if (pid < 0)
+	fprintf(stderr, "%s: unable to execute %s (%s): %s\n",
+	        dpkg_get_progname(), argv[0], filename, strerror(errno));
+
+    return pid;
+}
+
+/* Drop whatever the launcher inherited besides its socket and standard
+ * error. When started on first use, it can be in the middle of a request,
+ * holding a package or the output of a daemon client, which would then
+ * not see the end of it until the launcher goes away. */
+static void
+launcher_close_fds(int sock)
+{
+    struct dirent *ent;
+    DIR *dir;
+    long max;
+    int fd;
+
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+	dup2(fd, STDIN_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	if (fd > STDERR_FILENO)
+	    close(fd);
+    }
+
+    dir = opendir("/proc/self/fd");
+    if (dir) {
+	while ((ent = readdir(dir)) != NULL) {
+	    fd = atoi(ent->d_name);
+	    if (fd > STDERR_FILENO && fd != sock && fd != dirfd(dir))
+		close(fd);
+	}
+	closedir(dir);
+	return;
+    }
+
+    max = sysconf(_SC_OPEN_MAX);
+    if (max < 0 || max > 65536)
+	max = 65536;
+    for (fd = STDERR_FILENO + 1; fd < max; fd++)
+	if (fd != sock)
+	    close(fd);
+}
+
+/* The launcher loop: start whatever gets asked for, and tell each asker
+ * how it ended. It goes away once every process that could send it a
+ * request has closed its socket, and the programs it started are done. */
+static void DPKG_ATTR_NORET
+launcher_run(int sock)
+{
+    struct launch *running = NULL, *l, **lp;
+    struct sigaction sa;
+    struct pollfd pfd[2];
+    char *buf;
+    bool accepting = true;
+
+    launcher_close_fds(sock);
+
+    buf = m_malloc(LAUNCHER_MSG_MAX);
+
+    if (pipe2(launcher_wake, O_CLOEXEC | O_NONBLOCK) < 0)
+	_exit(1);
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = launcher_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    while (accepting || running) {
+	int nfds = 0;
+
+	pfd[nfds].fd = launcher_wake[0];
+	pfd[nfds++].events = POLLIN;
+	if (accepting) {
+	    pfd[nfds].fd = sock;
+	    pfd[nfds++].events = POLLIN;
+	}
+
+	if (poll(pfd, nfds, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    _exit(1);
+	}
+
+	if (pfd[0].revents) {
+	    char drain[64];
+	    int status;
+	    pid_t pid;
+
+	    while (read(launcher_wake[0], drain, sizeof(drain)) > 0)
+		;
+	    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (lp = &running; *lp; lp = &(*lp)->next)
+		    if ((*lp)->pid == pid)
+			break;
+		if (*lp == NULL)
+		    continue;
+		l = *lp;
+		*lp = l->next;
+		if (fd_write(l->reply_fd, &status, sizeof(status)) < 0) {
+		    /* The asker is gone, nobody to tell. */
+		}
+		close(l->reply_fd);
+		free(l);
+	    }
+	}
+
+	if (accepting && pfd[1].revents) {
+	    int fds[LAUNCHER_NFDS];
+	    ssize_t r;
+	    pid_t pid;
+	    int i;
+
+	    r = launcher_recv(sock, buf, fds);
+	    if (r == 0) {
+		accepting = false;
+		continue;
+	    }
+	    if (r < 0)
+		continue;
+
+	    pid = launcher_exec(buf, r, fds);
+	    for (i = 0; i < LAUNCHER_NFDS - 1; i++)
+		close(fds[i]);
+	    if (pid < 0) {
+		close(fds[LAUNCHER_NFDS - 1]);
+		continue;
+	    }
+
+	    l = m_malloc(sizeof(*l));
+	    l->pid = pid;
+	    l->reply_fd = fds[LAUNCHER_NFDS - 1];
+	    l->next = running;
+	    running = l;
+	}
+    }
+
+    _exit(0);
+}
+
+/* Start the launcher, a small co-process that spawns gpg on behalf of
+ * this process and of any worker forked from it later on. This needs to be
+ * done early, while this process is still small, as starting programs from
+ * the launcher then stays cheap however large this process and its workers
+ * grow with the policies, keyrings and packages they load, even where
+ * posix_spawn() falls back to a plain fork(). */
+int
+gpg_launcher_start(void)
+{
+    int sv[2];
+    pid_t pid;
+
+    launcher_deferred = false;
+    if (launcher_fd >= 0)
+	return 0;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+	return -1;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid < 0) {
+	close(sv[0]);
+	close(sv[1]);
+	return -1;
+    }
+    if (pid == 0) {
+	close(sv[0]);
+	launcher_run(sv[1]);
+    }
+    close(sv[1]);
+
+    /* The launcher only exits once we and our workers are gone, so it
+     * does not get waited for. */
+    launcher_fd = sv[0];
+
+    ds_printf(DS_LEV_DEBUG, "gpg_launcher_start: launcher is %d", pid);
+
+    return 0;
+}
+
+/* Have the launcher started on the first gpg run instead, for when gpg
+ * might not be needed at all, as with the native backend, which only falls
+ * back to it for what it cannot handle. */
+void
+gpg_launcher_defer(void)
+{
+    if (launcher_fd < 0)
+	launcher_deferred = true;
+}
+
+/* Ask the launcher to start a command. Returns the socket its wait status
+ * comes back on, or -1 if the launcher cannot do it. */
+static int
+gpg_launcher_spawn(struct command *cmd, const int *fds)
+{
+    union {
+	char buf[CMSG_SPACE(LAUNCHER_NFDS * sizeof(int))];
+	struct cmsghdr align;
+    } control;
+    char buf[LAUNCHER_MSG_MAX];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int reply[2], sendfds[LAUNCHER_NFDS];
+    size_t len = 0, n;
+    ssize_t r;
+    int i;
+
+    n = strlen(cmd->filename) + 1;
+    if (n > sizeof(buf))
+	return -1;
+    memcpy(buf, cmd->filename, n);
+    len = n;
+    for (i = 0; i < cmd->argc; i++) {
+	n = strlen(cmd->argv[i]) + 1;
+	if (len + n > sizeof(buf))
+	    return -1;
+	memcpy(buf + len, cmd->argv[i], n);
+	len += n;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, reply) < 0)
+	return -1;
+
+    memcpy(sendfds, fds, (LAUNCHER_NFDS - 1) * sizeof(int));
+    sendfds[LAUNCHER_NFDS - 1] = reply[1];
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(sendfds));
+    memcpy(CMSG_DATA(cmsg), sendfds, sizeof(sendfds));
+
+    do {
+	r = sendmsg(launcher_fd, &msg, MSG_NOSIGNAL);
+    } while (r < 0 && errno == EINTR);
+    close(reply[1]);
+    if (r < 0) {
+	ds_printf(DS_LEV_DEBUG, "gpg_launcher_spawn: launcher gone: %s",
+	          strerror(errno));
+	close(reply[0]);
+	close(launcher_fd);
+	launcher_fd = -1;
+	return -1;
+    }
+
+    return reply[0];
+}
+
+/* Create a pipe not to be inherited by gpg, other than by the ends passed
+ * to gpg_spawn(). */
+void
+gpg_pipe(int fds[2])
+{
+    if (pipe2(fds, O_CLOEXEC) < 0)
+	ohshite("cannot create pipe for gpg");
+}
+
+/* Hold off SIGPIPE while writing to gpg, which can go away before reading
+ * everything, so that the write fails with EPIPE instead. The disposition
+ * belongs to the program we run in, so the signal only gets blocked in
+ * this thread, until gpg_sigpipe_restore(). */
+void
+gpg_sigpipe_block(struct gpg_sigpipe *sp)
+{
+    sigset_t set, pending;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    if (sigprocmask(SIG_BLOCK, &set, &sp->oldmask) < 0)
+	ohshite("cannot block SIGPIPE");
+    /* One already pending is not ours to take. */
+    sp->pending = sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE);
+}
+
+/* Discard any SIGPIPE raised while it was held off, and restore the signal
+ * mask. */
+void
+gpg_sigpipe_restore(struct gpg_sigpipe *sp)
+{
+    static const struct timespec nowait;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    if (!sp->pending)
+	while (sigtimedwait(&set, NULL, &nowait) == SIGPIPE)
+	    ;
+    if (sigprocmask(SIG_SETMASK, &sp->oldmask, NULL) < 0)
+	ohshite("cannot restore the signal mask");
+}
+
+/* Start a gpg command, with fd_in and fd_out as its standard input and
+ * output, or our own if negative. Its standard error is ours when
+ * debugging, and goes nowhere otherwise. */
+void
+gpg_spawn(struct gpg_proc *proc, struct command *cmd, int fd_in, int fd_out)
+{
+    int fds[LAUNCHER_NFDS - 1];
+
+    fds[0] = fd_in >= 0 ? fd_in : STDIN_FILENO;
+    fds[1] = fd_out >= 0 ? fd_out : STDOUT_FILENO;
+    if (DS_LEV_DEBUG >= ds_debug_level) {
+	fds[2] = STDERR_FILENO;
+    } else {
+	fds[2] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (fds[2] < 0)
+	    ohshite("cannot open %s", "/dev/null");
+    }
+
+    proc->pid = -1;
+    proc->reply_fd = -1;
+    if (launcher_deferred && gpg_launcher_start() < 0)
+	ds_printf(DS_LEV_DEBUG, "cannot start the gpg launcher: %s",
+	          strerror(errno));
+    if (launcher_fd >= 0)
+	proc->reply_fd = gpg_launcher_spawn(cmd, fds);
+
+    if (proc->reply_fd < 0) {
+	proc->pid = spawn_program(cmd->filename, (char **)cmd->argv, fds);
+	if (proc->pid < 0)
+	    ds_printf(DS_LEV_ERR, "unable to execute %s (%s): %s",
+	              cmd->name, cmd->filename, strerror(errno));
+    }
+
+    if (fds[2] != STDERR_FILENO)
+	close(fds[2]);
+}
+
+/* Wait for a gpg command to finish. Returns 0 if it exited successfully,
+ * otherwise its exit status or the signal that killed it. */
+int
+gpg_wait(struct gpg_proc *proc, const char *desc)
+{
+    int status;
+
+    if (proc->pid >= 0)
+	return subproc_reap(proc->pid, desc, SUBPROC_RETERROR | SUBPROC_RETSIGNO);
+    if (proc->reply_fd < 0)
+	return -1;
+
+    if (fd_read(proc->reply_fd, &status, sizeof(status)) != sizeof(status)) {
+	ds_printf(DS_LEV_DEBUG, "%s: lost track of gpg", desc);
+	status = -1;
+    }
+    close(proc->reply_fd);
+
+    if (status == -1)
+	return -1;
+    if (WIFEXITED(status))
+	return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+	return WTERMSIG(status);
+
+    return -1;
+}
@@ -0,0 +1,778 @@
+/*
+ * debsig-verify - Debian package signature verification tool
+ *
+ * Copyright © 2026 Guillem Jover <guillem@debian.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * reads OpenPGP keyrings natively, and indexes them by user ID and key ID
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gcrypt.h>
+
+#include <dpkg/dpkg.h>
+#include <dpkg/fdio.h>
+
+#include "debsig.h"
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+void
+pgp_crypto_init(void)
+{
+    static int inited = 0;
+
+    if (inited)
+	return;
+
+    if (!gcry_check_version(GCRYPT_VERSION))
+	ohshit("libgcrypt version mismatch");
+    gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+    gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+    inited = 1;
+}
+
+/* Compute the fingerprint and key ID of a public key packet. */
+static int
+pgp_key_ids(struct pgp_key *key, const uint8_t *body, size_t len)
+{
+    gcry_md_hd_t md;
+    uint8_t hdr[5];
+
+    if (key->version == 3) {
+	const uint8_t *n = body + 8;
+	size_t nbits, nlen;
+
+	/* The key ID is the low 64 bits of the RSA modulus, and the MD5
+	 * based fingerprint is of no use to us. */
+	if (len < 10)
+	    return PGP_ERR_MALFORMED;
+	nbits = (n[0] << 8) | n[1];
+	nlen = (nbits + 7) / 8;
+	if (nlen < 8 || 10 + nlen > len)
+	    return PGP_ERR_MALFORMED;
+	memcpy(key->keyid, n + 2 + nlen - 8, sizeof(key->keyid));
+	key->fpr_len = 0;
+	return PGP_OK;
+    }
+
+    pgp_crypto_init();
+
+    if (key->version == 4) {
+	if (gcry_md_open(&md, GCRY_MD_SHA1, 0))
+	    ohshit("cannot initialize SHA-1 digest");
+	hdr[0] = 0x99;
+	hdr[1] = (len >> 8) & 0xff;
+	hdr[2] = len & 0xff;
+	gcry_md_write(md, hdr, 3);
+	key->fpr_len = 20;
+    } else {
+	if (gcry_md_open(&md, GCRY_MD_SHA256, 0))
+	    ohshit("cannot initialize SHA-256 digest");
+	hdr[0] = 0x9a;
+	hdr[1] = (len >> 24) & 0xff;
+	hdr[2] = (len >> 16) & 0xff;
+	hdr[3] = (len >> 8) & 0xff;
+	hdr[4] = len & 0xff;
+	gcry_md_write(md, hdr, 5);
+	key->fpr_len = 32;
+    }
+    gcry_md_write(md, body, len);
+    memcpy(key->fpr, gcry_md_read(md, 0), key->fpr_len);
+    gcry_md_close(md);
+
+    if (key->version == 4)
+	memcpy(key->keyid, key->fpr + 12, sizeof(key->keyid));
+    else
+	memcpy(key->keyid, key->fpr, sizeof(key->keyid));
+
+    return PGP_OK;
+}
+
+static int
+pgp_parse_key_packet(struct pgp_key *key, const uint8_t *body, size_t len)
+{
+    unsigned int days;
+
+    if (len < 1)
+	return PGP_ERR_MALFORMED;
+
+    key->packet = body;
+    key->packet_len = len;
+    key->flags = -1;
+
+    key->version = body[0];
+    switch (key->version) {
+    case 2:
+    case 3:
+	if (len < 8)
+	    return PGP_ERR_MALFORMED;
+	key->version = 3;
+	key->created = get_be32(body + 1);
+	/* Version 3 keys carry their own validity period, in days. */
+	days = (body[5] << 8) | body[6];
+	if (days)
+	    key->expires = key->created + days * 86400;
+	key->pubkey_algo = body[7];
+	key->material = body + 8;
+	key->material_len = len - 8;
+	break;
+    case 4:
+	if (len < 6)
+	    return PGP_ERR_MALFORMED;
+	key->created = get_be32(body + 1);
+	key->pubkey_algo = body[5];
+	key->material = body + 6;
+	key->material_len = len - 6;
+	break;
+    case 5:
+	if (len < 10 || get_be32(body + 6) != len - 10)
+	    return PGP_ERR_MALFORMED;
+	key->created = get_be32(body + 1);
+	key->pubkey_algo = body[5];
+	key->material = body + 10;
+	key->material_len = len - 10;
+	break;
+    default:
+	return PGP_ERR_UNSUPPORTED;
+    }
+
+    return pgp_key_ids(key, body, len);
+}
+
+/* The key block being indexed: its primary key, and the user ID or the
+ * subkey that the signatures which follow are about. */
+struct key_block {
+    struct keyring *kr;
+    struct pgp_key *primary;
+    struct pgp_key *subkey;
+    const uint8_t *uid;
+    size_t uid_len;
+    bool uid_bound;
+    time_t uid_bound_at;
+    time_t uid_bound_until;
+    bool uid_revoked;
+    time_t uid_revoked_at;
+    bool uid_unchecked;
+    /* Whether the signatures are about something we do not look at, such
+     * as a user attribute. */
+    bool skip;
+};
+
+/* Index the user ID done with, if it has a valid self-signature and has
+ * not been revoked since, or if gpg needs to be asked about it. The keys
+ * sharing a user ID are kept in keyring order. */
+static void
+key_block_uid_done(struct key_block *kb)
+{
+    struct keyring *kr = kb->kr;
+
+    if (kb->uid && (kb->uid_unchecked ||
+                    (kb->uid_bound && !(kb->uid_revoked &&
+                                        kb->uid_revoked_at >= kb->uid_bound_at)))) {
+	struct key_uid *ku, *first;
+
+	ku = m_malloc(sizeof(*ku));
+	ku->key = kb->primary;
+	ku->expires = kb->uid_unchecked ? 0 : kb->uid_bound_until;
+	ku->same = NULL;
+	ku->next = kr->key_uids;
+	kr->key_uids = ku;
+
+	first = ds_hash_get(&kr->by_uid, kb->uid, kb->uid_len);
+	if (first == NULL) {
+	    ds_hash_put(&kr->by_uid, kb->uid, kb->uid_len, ku);
+	} else {
+	    while (first->same)
+		first = first->same;
+	    first->same = ku;
+	}
+    }
+
+    kb->uid = NULL;
+    kb->uid_bound = false;
+    kb->uid_bound_until = 0;
+    kb->uid_revoked = false;
+    kb->uid_unchecked = false;
+    kb->skip = false;
+}
+
+/* Extend until when something is bound by a valid self-signature, 0 being
+ * for ever. Expired self-signatures are only told apart when looking keys
+ * up, as the keyring can stay loaded for much longer than a verification. */
+static void
+bound_until_extend(bool bound, time_t *until, const struct pgp_sig *sig)
+{
+    time_t expires = sig->expires ? sig->created + sig->expires : 0;
+
+    if (!bound || (*until && (expires == 0 || expires > *until)))
+	*until = expires;
+}
+
+static bool
+bound_until_valid(time_t until, time_t now)
+{
+    return until == 0 || until > now;
+}
+
+/* Take the expiry and flags of a key from a valid self-signature over it,
+ * if it is the latest one. Returns whether it was. */
+static bool
+key_self_sig(struct pgp_key *key, const struct pgp_sig *sig)
+{
+    if (key->bound_at > sig->created)
+	return false;
+
+    key->bound_at = sig->created;
+    key->flags = sig->key_flags;
+    if (key->version > 3)
+	key->expires = sig->key_expires ? key->created + sig->key_expires : 0;
+
+    return true;
+}
+
+/* Check the back signature a signing subkey makes over its primary key,
+ * embedded in its binding signature. */
+static int
+key_cross_certified(const struct pgp_key *primary, const struct pgp_key *subkey,
+                    const struct pgp_sig *binding)
+{
+    struct pgp_sig back;
+    int rc;
+
+    if (binding->embedded == NULL)
+	return 0;
+
+    rc = pgp_parse_sig_packet(binding->embedded, binding->embedded_len, &back);
+    if (rc < 0)
+	return rc == PGP_ERR_UNSUPPORTED ? -1 : 0;
+    if (back.sig_class != PGP_SIG_PRIMARY_BINDING ||
+        (back.has_keyid && memcmp(back.keyid, subkey->keyid, 8) != 0))
+	return 0;
+
+    return pgp_check_key_sig(subkey, &back, primary, subkey, NULL, 0);
+}
+
+/* Check a signature in a key block, and record what it says about the
+ * primary key, the current user ID or the current subkey. Signatures made
+ * by other keys are certifications we have no use for. */
+static void
+key_block_sig(struct key_block *kb, const uint8_t *body, size_t len)
+{
+    struct pgp_key *primary = kb->primary;
+    struct pgp_key *key;
+    struct pgp_sig sig;
+    int rc;
+
+    if (primary == NULL || kb->skip)
+	return;
+
+    key = kb->subkey ? kb->subkey : primary;
+
+    rc = pgp_parse_sig_packet(body, len, &sig);
+    if (rc == PGP_ERR_UNSUPPORTED) {
+	/* It might be a self-signature in a newer format. */
+	key->unchecked = true;
+	if (kb->uid)
+	    kb->uid_unchecked = true;
+	return;
+    }
+    if (rc < 0)
+	return;
+
+    if (!sig.has_keyid || memcmp(sig.keyid, primary->keyid, 8) != 0) {
+	/* A revocation made by another key might come from a designated
+	 * revoker, which only gpg knows how to deal with. */
+	if (sig.sig_class == PGP_SIG_KEY_REVOCATION ||
+	    sig.sig_class == PGP_SIG_SUBKEY_REVOCATION)
+	    key->unchecked = true;
+	return;
+    }
+
+    /* Self-signatures older than the key do not count. */
+    if (sig.created < key->created)
+	return;
+
+    switch (sig.sig_class) {
+    case PGP_SIG_CERT_GENERIC:
+    case PGP_SIG_CERT_GENERIC + 1:
+    case PGP_SIG_CERT_GENERIC + 2:
+    case PGP_SIG_CERT_POSITIVE:
+    case PGP_SIG_CERT_REVOCATION:
+	if (kb->uid == NULL)
+	    return;
+	rc = pgp_check_key_sig(primary, &sig, primary, NULL,
+	                       kb->uid, kb->uid_len);
+	if (rc < 0) {
+	    primary->unchecked = true;
+	    kb->uid_unchecked = true;
+	} else if (rc && sig.sig_class == PGP_SIG_CERT_REVOCATION) {
+	    if (!kb->uid_revoked || sig.created > kb->uid_revoked_at)
+		kb->uid_revoked_at = sig.created;
+	    kb->uid_revoked = true;
+	} else if (rc) {
+	    if (!kb->uid_bound || sig.created > kb->uid_bound_at)
+		kb->uid_bound_at = sig.created;
+	    bound_until_extend(kb->uid_bound, &kb->uid_bound_until, &sig);
+	    kb->uid_bound = true;
+	    bound_until_extend(primary->bound, &primary->bound_until, &sig);
+	    primary->bound = true;
+	    key_self_sig(primary, &sig);
+	}
+	break;
+    case PGP_SIG_DIRECT_KEY:
+    case PGP_SIG_KEY_REVOCATION:
+	rc = pgp_check_key_sig(primary, &sig, primary, NULL, NULL, 0);
+	if (rc < 0)
+	    primary->unchecked = true;
+	else if (rc && sig.sig_class == PGP_SIG_KEY_REVOCATION)
+	    primary->revoked = true;
+	else if (rc)
+	    key_self_sig(primary, &sig);
+	break;
+    case PGP_SIG_SUBKEY_BINDING:
+    case PGP_SIG_SUBKEY_REVOCATION:
+	if (kb->subkey == NULL)
+	    return;
+	rc = pgp_check_key_sig(primary, &sig, primary, kb->subkey, NULL, 0);
+	if (rc < 0) {
+	    kb->subkey->unchecked = true;
+	} else if (rc && sig.sig_class == PGP_SIG_SUBKEY_REVOCATION) {
+	    if (!kb->subkey->revoked || sig.created > kb->subkey->revoked_at)
+		kb->subkey->revoked_at = sig.created;
+	    kb->subkey->revoked = true;
+	} else if (rc) {
+	    bound_until_extend(kb->subkey->bound, &kb->subkey->bound_until,
+	                       &sig);
+	    kb->subkey->bound = true;
+	    if (!key_self_sig(kb->subkey, &sig))
+		break;
+	    rc = key_cross_certified(primary, kb->subkey, &sig);
+	    if (rc < 0)
+		kb->subkey->unchecked = true;
+	    kb->subkey->cross_certified = rc > 0;
+	}
+	break;
+    default:
+	break;
+    }
+}
+
+/* Index the keys of a keyring by key ID, and their user IDs, checking the
+ * self-signatures and binding signatures as we go. Keys get indexed even
+ * when these are not valid, so that keyring_key_usable() can tell why
+ * they cannot be used. */
+static int
+keyring_index(struct keyring *kr, const uint8_t *p, size_t len)
+{
+    struct key_block kb;
+    struct pgp_key **tail = &kr->keys;
+
+    memset(&kb, 0, sizeof(kb));
+    kb.kr = kr;
+
+    for (;;) {
+	struct pgp_key *key;
+	const uint8_t *body;
+	size_t body_len;
+	int tag, rc;
+
+	rc = pgp_packet_next(&p, &len, &tag, &body, &body_len);
+	if (rc == PGP_ERR_END)
+	    break;
+	if (rc < 0)
+	    return rc;
+
+	switch (tag) {
+	case PGP_PKT_PUBLIC_KEY:
+	case PGP_PKT_PUBLIC_SUBKEY:
+	    key_block_uid_done(&kb);
+	    kb.subkey = NULL;
+	    key = m_malloc(sizeof(*key));
+	    memset(key, 0, sizeof(*key));
+	    rc = pgp_parse_key_packet(key, body, body_len);
+	    if (rc == PGP_ERR_UNSUPPORTED) {
+		/* Skip keys we cannot handle, and anything tied to them. */
+		free(key);
+		if (tag == PGP_PKT_PUBLIC_KEY)
+		    kb.primary = NULL;
+		kb.skip = true;
+		continue;
+	    }
+	    if (rc < 0) {
+		free(key);
+		return rc;
+	    }
+	    if (tag == PGP_PKT_PUBLIC_KEY) {
+		kb.primary = key;
+	    } else if (kb.primary == NULL) {
+		free(key);
+		continue;
+	    } else {
+		kb.subkey = key;
+	    }
+	    key->primary = kb.primary;
+	    pgp_keyid_str(key->keyid, key->keyid_str);
+
+	    *tail = key;
+	    tail = &key->next;
+	    ds_hash_put(&kr->by_keyid, key->keyid, sizeof(key->keyid), key);
+	    break;
+	case PGP_PKT_USER_ID:
+	    key_block_uid_done(&kb);
+	    kb.subkey = NULL;
+	    kb.uid = body;
+	    kb.uid_len = body_len;
+	    break;
+	case PGP_PKT_USER_ATTRIBUTE:
+	    key_block_uid_done(&kb);
+	    kb.subkey = NULL;
+	    kb.skip = true;
+	    break;
+	case PGP_PKT_SIGNATURE:
+	    key_block_sig(&kb, body, body_len);
+	    break;
+	default:
+	    break;
+	}
+    }
+    key_block_uid_done(&kb);
+
+    return PGP_OK;
+}
+
+/* Drop what got loaded from a keyring, keeping its cache entry. */
+static void
+keyring_reset(struct keyring *kr)
+{
+    while (kr->keys) {
+	struct pgp_key *key = kr->keys;
+
+	kr->keys = key->next;
+	free(key);
+    }
+    while (kr->key_uids) {
+	struct key_uid *ku = kr->key_uids;
+
+	kr->key_uids = ku->next;
+	free(ku);
+    }
+    while (kr->uids) {
+	struct keyring_uid *ku = kr->uids;
+
+	kr->uids = ku->next;
+	free(ku->keyid);
+	free(ku);
+    }
+    ds_hash_destroy(&kr->by_uid);
+    ds_hash_destroy(&kr->by_keyid);
+    ds_hash_destroy(&kr->resolved);
+    free(kr->data);
+    kr->data = NULL;
+    kr->len = 0;
+}
+
+static void
+keyring_free(struct keyring *kr)
+{
+    keyring_reset(kr);
+    free(kr->path);
+    free(kr);
+}
+
+static bool
+keyring_is_current(const struct keyring *kr, const struct stat *st)
+{
+    return kr->dev == st->st_dev && kr->ino == st->st_ino &&
+           kr->size == st->st_size &&
+           kr->mtime.tv_sec == st->st_mtim.tv_sec &&
+           kr->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static int
+keyring_read(struct keyring *kr)
+{
+    struct stat st;
+    ssize_t r;
+    int fd;
+
+    fd = open(kr->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	ds_printf(DS_LEV_DEBUG, "keyring_read: cannot open %s: %s",
+	          kr->path, strerror(errno));
+	return -1;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+	ds_printf(DS_LEV_DEBUG, "keyring_read: %s is not a regular file",
+	          kr->path);
+	close(fd);
+	return -1;
+    }
+
+    /* Identify the file we actually read, for later freshness checks. */
+    kr->dev = st.st_dev;
+    kr->ino = st.st_ino;
+    kr->size = st.st_size;
+    kr->mtime = st.st_mtim;
+
+    kr->len = st.st_size;
+    kr->data = m_malloc(kr->len + 1);
+    r = fd_read(fd, kr->data, kr->len);
+    close(fd);
+    if (r < 0 || (size_t)r != kr->len) {
+	ds_printf(DS_LEV_DEBUG, "keyring_read: cannot read %s", kr->path);
+	return -1;
+    }
+    kr->data[kr->len] = '\0';
+
+    return 0;
+}
+
+/* Read and index a keyring, setting its status to whether it can be used
+ * natively, is in a format we do not understand (such as a GnuPG keybox),
+ * in which case the caller can resort to asking gpg, or is unusable. */
+static void
+keyring_load(struct keyring *kr)
+{
+    const uint8_t *p;
+    size_t len;
+    int rc;
+
+    ds_hash_init(&kr->by_uid);
+    ds_hash_init(&kr->by_keyid);
+    ds_hash_init(&kr->resolved);
+
+    if (keyring_read(kr) < 0) {
+	kr->status = PGP_ERR_MALFORMED;
+	return;
+    }
+
+    p = kr->data;
+    len = kr->len;
+    if (len >= 12 && memcmp(p + 8, "KBXf", 4) == 0) {
+	ds_printf(DS_LEV_DEBUG, "keyring_load: %s is a keybox, not supported",
+	          kr->path);
+	kr->status = PGP_ERR_UNSUPPORTED;
+	return;
+    }
+    if (len > 0 && !(p[0] & 0x80)) {
+	uint8_t *raw;
+	size_t raw_len;
+
+	rc = pgp_dearmor((const char *)p, len, &raw, &raw_len);
+	if (rc < 0) {
+	    kr->status = PGP_ERR_UNSUPPORTED;
+	    return;
+	}
+	free(kr->data);
+	kr->data = raw;
+	kr->len = raw_len;
+    }
+
+    rc = keyring_index(kr, kr->data, kr->len);
+    if (rc < 0) {
+	ds_printf(DS_LEV_DEBUG, "keyring_load: cannot parse %s", kr->path);
+	kr->status = PGP_ERR_UNSUPPORTED;
+	return;
+    }
+
+    ds_printf(DS_LEV_DEBUG, "keyring_load: indexed %zu keys and %zu user IDs from %s",
+              kr->by_keyid.count, kr->by_uid.count, kr->path);
+
+    kr->status = PGP_OK;
+}
+
+/* Get a keyring, loading and indexing it on first use. It gets reloaded
+ * when its device, inode, size or modification time change, which is
+ * checked once per package verified with the context. NULL is returned if
+ * the keyring cannot be found, otherwise the status tells whether it can
+ * be used natively, see keyring_load(). */
+struct keyring *
+keyring_get(struct debsig_ctx *ctx, const char *path, int *status)
+{
+    struct keyring *kr;
+    struct stat st;
+
+    if (ctx->keyring_index.buckets == NULL)
+	ds_hash_init(&ctx->keyring_index);
+
+    kr = ds_hash_get(&ctx->keyring_index, path, strlen(path));
+    if (kr && kr->checked == ctx->generation) {
+	*status = kr->status;
+	return kr;
+    }
+
+    if (stat(path, &st) < 0) {
+	ds_printf(DS_LEV_DEBUG, "keyring_get: cannot stat %s: %s",
+	          path, strerror(errno));
+	*status = PGP_ERR_MALFORMED;
+	return NULL;
+    }
+
+    if (kr == NULL) {
+	kr = m_malloc(sizeof(*kr));
+	memset(kr, 0, sizeof(*kr));
+	kr->path = m_strdup(path);
+	kr->next = ctx->keyrings;
+	ctx->keyrings = kr;
+	ds_hash_put(&ctx->keyring_index, kr->path, strlen(kr->path), kr);
+	keyring_load(kr);
+    } else if (!keyring_is_current(kr, &st)) {
+	ds_printf(DS_LEV_DEBUG, "keyring_get: %s changed, reloading", path);
+	keyring_reset(kr);
+	keyring_load(kr);
+    }
+    kr->checked = ctx->generation;
+
+    *status = kr->status;
+    return kr;
+}
+
+/* Release the keyrings loaded by a context. */
+void
+keyring_cache_free(struct debsig_ctx *ctx)
+{
+    struct keyring *kr;
+
+    while ((kr = ctx->keyrings)) {
+	ctx->keyrings = kr->next;
+	keyring_free(kr);
+    }
+    ds_hash_destroy(&ctx->keyring_index);
+}
+
+/* Look up what a user ID got resolved to in a keyring before, if it still
+ * holds. */
+const struct keyring_uid *
+keyring_uid_get(const struct keyring *kr, const char *uid, time_t now)
+{
+    const struct keyring_uid *ku;
+
+    ku = ds_hash_get(&kr->resolved, uid, strlen(uid));
+    if (ku && !bound_until_valid(ku->expires, now))
+	return NULL;
+
+    return ku;
+}
+
+/* Remember the key ID a user ID resolves to in a keyring, NULL if none,
+ * until expires, if not 0. */
+const struct keyring_uid *
+keyring_uid_put(struct keyring *kr, const char *uid, const char *keyid,
+                time_t expires)
+{
+    struct keyring_uid *ku;
+    size_t len = strlen(uid);
+
+    ku = ds_hash_get(&kr->resolved, uid, len);
+    if (ku) {
+	free(ku->keyid);
+    } else {
+	ku = m_malloc(sizeof(*ku) + len + 1);
+	memcpy(ku->uid, uid, len + 1);
+	ku->next = kr->uids;
+	kr->uids = ku;
+	ds_hash_put(&kr->resolved, ku->uid, len, ku);
+    }
+    ku->keyid = keyid ? m_strdup(keyid) : NULL;
+    ku->expires = expires;
+
+    return ku;
+}
+
+/* Find the first key with a user ID whose self-signatures have not all
+ * expired by now. */
+const struct key_uid *
+keyring_find_uid(const struct keyring *kr, const char *uid, time_t now)
+{
+    const struct key_uid *ku;
+
+    for (ku = ds_hash_get(&kr->by_uid, uid, strlen(uid)); ku; ku = ku->same)
+	if (bound_until_valid(ku->expires, now))
+	    return ku;
+
+    return NULL;
+}
+
+const struct pgp_key *
+keyring_find_keyid(const struct keyring *kr, const uint8_t *keyid)
+{
+    return ds_hash_get(&kr->by_keyid, keyid, 8);
+}
+
+/* Tell whether a key can be used for checking signatures now, from what
+ * its self-signatures say about it and about its primary key. Returns 1 if
+ * it can, 0 if it cannot, and -1 if some of them could not be checked, in
+ * which case gpg needs to be asked instead. */
+int
+keyring_key_usable(const struct pgp_key *key, time_t now)
+{
+    const struct pgp_key *primary = key->primary;
+    const char *why = NULL;
+
+    if (primary->unchecked || key->unchecked) {
+	ds_printf(DS_LEV_DEBUG, "keyring_key_usable: cannot check the "
+	          "self-signatures of key %s", key->keyid_str);
+	return -1;
+    }
+
+    if (!primary->bound || !bound_until_valid(primary->bound_until, now))
+	why = "primary key has no valid user ID";
+    else if (primary->revoked)
+	why = "primary key is revoked";
+    else if (primary->expires && primary->expires <= now)
+	why = "primary key is expired";
+    else if (key != primary &&
+             (!key->bound || !bound_until_valid(key->bound_until, now)))
+	why = "is not bound to its primary key";
+    else if (key != primary && key->revoked &&
+             key->revoked_at >= key->bound_at)
+	why = "is revoked";
+    else if (key != primary && key->expires && key->expires <= now)
+	why = "is expired";
+    else if (key->flags >= 0 && !(key->flags & PGP_KEY_FLAG_SIGN))
+	why = "is not a signing key";
+    else if (key != primary && !key->cross_certified)
+	why = "has no valid back signature";
+
+    if (why) {
+	ds_printf(DS_LEV_DEBUG, "keyring_key_usable: key %s %s",
+	          key->keyid_str, why);
+	return 0;
+    }
+
+    return 1;
+}
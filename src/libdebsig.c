@@ -0,0 +1,247 @@
+/*
+ * libdebsig - Debian package signature verification library
+ *
+ * Copyright © 2026 Guillem Jover <guillem@debian.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * library entry points, and the verification context
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+
+#include <dpkg/dpkg.h>
+
+#include "debsig.h"
+
+/* Keep the message of a fatal error for the caller, instead of printing
+ * it. */
+static void
+ds_catch_error(const char *emsg, const void *data)
+{
+    struct debsig_result *res = (struct debsig_result *)data;
+
+    free(res->error);
+    res->error = strdup(emsg);
+}
+
+/* Verify one package, either by name or from an open file descriptor if
+ * fd is not negative, which then gets closed. Any fatal error only affects
+ * this package, and gets reported as its internal failure exit class, with
+ * the error message in the result. */
+int
+verifyPackage(struct debsig_ctx *ctx, const char *filename, int fd,
+              const struct verify_opts *opts, struct debsig_result *res)
+{
+    jmp_buf ejbuf;
+    struct deb_archive *volatile deb = NULL;
+    volatile int rc;
+    int saved_level;
+
+    saved_level = ds_debug_level;
+    ds_debug_level = ctx->log_level;
+    ctx->generation++;
+
+    if (setjmp(ejbuf)) {
+	pop_error_context(ehflag_bombout);
+	rc = DS_FAIL_INTERNAL;
+    } else {
+	push_error_context_jump(&ejbuf, ds_catch_error, res);
+	if (fd < 0)
+	    deb = deb_archive_open(filename);
+	else
+	    deb = deb_archive_fdopen(filename, fd);
+	rc = verifyDeb(ctx, deb, opts, res);
+	pop_error_context(ehflag_normaltidy);
+    }
+
+    /* Closing can fail too, which must not take the caller down either. */
+    if (deb) {
+	if (setjmp(ejbuf)) {
+	    pop_error_context(ehflag_bombout);
+	    rc = DS_FAIL_INTERNAL;
+	} else {
+	    push_error_context_jump(&ejbuf, ds_catch_error, res);
+	    deb_archive_close(deb);
+	    pop_error_context(ehflag_normaltidy);
+	}
+    }
+
+    ds_debug_level = saved_level;
+    res->status = rc;
+
+    return rc;
+}
+
+static int
+ctx_set_str(char **field, const char *value)
+{
+    char *str;
+
+    str = strdup(value);
+    if (str == NULL)
+	return -1;
+    free(*field);
+    *field = str;
+
+    return 0;
+}
+
+/* Forget what got loaded with the previous configuration. */
+static void
+ctx_flush(struct debsig_ctx *ctx)
+{
+    origin_cache_free(ctx->origins);
+    ctx->origins = NULL;
+    sig_types_free(ctx);
+    keyring_cache_free(ctx);
+}
+
+struct debsig_ctx *
+debsig_ctx_new(void)
+{
+    struct debsig_ctx *ctx;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+	return NULL;
+
+    ctx->backend = DEBSIG_BACKEND_NATIVE;
+    ctx->log_level = DS_LEV_NONE;
+
+    if (ctx_set_str(&ctx->rootdir, "") < 0 ||
+        ctx_set_str(&ctx->policies_dir, DEBSIG_POLICIES_DIR) < 0 ||
+        ctx_set_str(&ctx->keyrings_dir, DEBSIG_KEYRINGS_DIR) < 0 ||
+        ctx_set_str(&ctx->cache_dir, DEBSIG_CACHE_DIR) < 0) {
+	debsig_ctx_free(ctx);
+	return NULL;
+    }
+
+    return ctx;
+}
+
+void
+debsig_ctx_free(struct debsig_ctx *ctx)
+{
+    if (ctx == NULL)
+	return;
+
+    ctx_flush(ctx);
+    gpg_tmpdir_remove(ctx);
+    free(ctx->rootdir);
+    free(ctx->policies_dir);
+    free(ctx->keyrings_dir);
+    free(ctx->cache_dir);
+    free(ctx);
+}
+
+int
+debsig_ctx_set_root(struct debsig_ctx *ctx, const char *dir)
+{
+    ctx_flush(ctx);
+    return ctx_set_str(&ctx->rootdir, dir ? dir : "");
+}
+
+int
+debsig_ctx_set_policies_dir(struct debsig_ctx *ctx, const char *dir)
+{
+    ctx_flush(ctx);
+    return ctx_set_str(&ctx->policies_dir, dir ? dir : DEBSIG_POLICIES_DIR);
+}
+
+int
+debsig_ctx_set_keyrings_dir(struct debsig_ctx *ctx, const char *dir)
+{
+    ctx_flush(ctx);
+    return ctx_set_str(&ctx->keyrings_dir, dir ? dir : DEBSIG_KEYRINGS_DIR);
+}
+
+int
+debsig_ctx_set_cache_dir(struct debsig_ctx *ctx, const char *dir)
+{
+    ctx_flush(ctx);
+    return ctx_set_str(&ctx->cache_dir, dir ? dir : DEBSIG_CACHE_DIR);
+}
+
+int
+debsig_ctx_set_gpg_cache(struct debsig_ctx *ctx, int enable)
+{
+    ctx->gpg_cache = enable;
+    return 0;
+}
+
+int
+debsig_ctx_set_backend(struct debsig_ctx *ctx, enum debsig_backend backend)
+{
+    switch (backend) {
+    case DEBSIG_BACKEND_NATIVE:
+    case DEBSIG_BACKEND_GPG:
+	ctx->backend = backend;
+	return 0;
+    default:
+	errno = EINVAL;
+	return -1;
+    }
+}
+
+enum debsig_status
+debsig_verify_file(struct debsig_ctx *ctx, const char *filename,
+                   const char *policy, struct debsig_result *res)
+{
+    struct verify_opts opts = { 0, policy };
+
+    memset(res, 0, sizeof(*res));
+
+    return verifyPackage(ctx, filename, -1, &opts, res);
+}
+
+enum debsig_status
+debsig_verify_fd(struct debsig_ctx *ctx, int fd, const char *name,
+                 const char *policy, struct debsig_result *res)
+{
+    struct verify_opts opts = { 0, policy };
+    int deb_fd;
+
+    memset(res, 0, sizeof(*res));
+
+    /* The package gets closed along with the archive, but the caller keeps
+     * its descriptor. */
+    deb_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (deb_fd < 0) {
+	res->status = DEBSIG_FAIL_INTERNAL;
+	res->error = strdup(strerror(errno));
+	return res->status;
+    }
+
+    return verifyPackage(ctx, name ? name : "-", deb_fd, &opts, res);
+}
+
+void
+debsig_result_destroy(struct debsig_result *res)
+{
+    free(res->origin);
+    free(res->policy);
+    free(res->policy_name);
+    free(res->policy_description);
+    free(res->error);
+    memset(res, 0, sizeof(*res));
+}
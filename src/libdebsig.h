@@ -0,0 +1,118 @@
+/*
+ * libdebsig - Debian package signature verification library
+ *
+ * Copyright © 2026 Guillem Jover <guillem@debian.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBDEBSIG_H
+#define LIBDEBSIG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The library is meant to be embedded in long-running programs, doing one
+ * verification at a time per process. A verification context holds the
+ * configuration, and the policies and keyrings loaded so far, which get
+ * reused by the next verifications done with it. Contexts are independent
+ * from each other, but the libdpkg error handling, the debug level, the
+ * crypto library setup and the gpg launcher are process-wide, so
+ * verifications must not run concurrently from several threads of the
+ * same process; use a process per concurrent verification instead.
+ */
+struct debsig_ctx;
+
+/* The outcome of a verification, which matches the debsig-verify exit
+ * status. */
+enum debsig_status {
+	DEBSIG_OK = 0,
+	DEBSIG_FAIL_NOSIGS = 10,
+	DEBSIG_FAIL_UNKNOWN_ORIGIN = 11,
+	DEBSIG_FAIL_NOPOLICIES = 12,
+	DEBSIG_FAIL_BADSIG = 13,
+	DEBSIG_FAIL_INTERNAL = 14,
+};
+
+enum debsig_backend {
+	DEBSIG_BACKEND_NATIVE,
+	DEBSIG_BACKEND_GPG,
+};
+
+struct debsig_result {
+	enum debsig_status status;
+	/* The key ID of the origin signature, if any. */
+	char *origin;
+	/* The file name, name and description of the policy used, if any. */
+	char *policy;
+	char *policy_name;
+	char *policy_description;
+	/* What went wrong, on internal failures. */
+	char *error;
+};
+
+struct debsig_ctx *
+debsig_ctx_new(void);
+void
+debsig_ctx_free(struct debsig_ctx *ctx);
+
+int
+debsig_ctx_set_root(struct debsig_ctx *ctx, const char *dir);
+int
+debsig_ctx_set_policies_dir(struct debsig_ctx *ctx, const char *dir);
+int
+debsig_ctx_set_keyrings_dir(struct debsig_ctx *ctx, const char *dir);
+int
+debsig_ctx_set_backend(struct debsig_ctx *ctx, enum debsig_backend backend);
+
+/*
+ * Set the directory with the compiled policy images, which get used in
+ * place of the policy files of an origin while these are unchanged.
+ */
+int
+debsig_ctx_set_cache_dir(struct debsig_ctx *ctx, const char *dir);
+
+/*
+ * Make gpg use a prepared gpg home per origin in the cache directory, with
+ * the keyrings converted to the keybox format, which get made again when
+ * their keyring changes. This is disabled by default.
+ */
+int
+debsig_ctx_set_gpg_cache(struct debsig_ctx *ctx, int enable);
+
+/*
+ * Verify a package, from its filename or from an open file descriptor,
+ * which is left open. A descriptor that cannot be seeked, such as a pipe,
+ * gets read once as a stream from its current position, and copied to a
+ * temporary file on the way. If policy is not NULL, only the policy file
+ * with that name is considered. The result must be released with
+ * debsig_result_destroy(), and its status is also returned.
+ */
+enum debsig_status
+debsig_verify_file(struct debsig_ctx *ctx, const char *filename,
+                   const char *policy, struct debsig_result *res);
+enum debsig_status
+debsig_verify_fd(struct debsig_ctx *ctx, int fd, const char *name,
+                 const char *policy, struct debsig_result *res);
+
+void
+debsig_result_destroy(struct debsig_result *res);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBDEBSIG_H */
@@ -24,8 +24,17 @@
 
 #include <config.h>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <obstack.h>
+
+#include <dpkg/dpkg.h>
 
 #include "debsig.h"
 
@@ -45,17 +54,184 @@ ds_printf(int level, const char *fmt, ...)
     }
 }
 
-off_t
-checkSigExist(struct dpkg_ar *deb, const char *name)
+/* The path of a keyring file of an origin, newly allocated. */
+char *
+ds_keyring_path(const struct debsig_ctx *ctx, const char *originID,
+                const char *file)
+{
+    char *path;
+
+    m_asprintf(&path, "%s%s/%s/%s", ctx->rootdir, ctx->keyrings_dir,
+               originID, file);
+
+    return path;
+}
+
+/* Whether something in the cache directory can be trusted, being owned by
+ * root or by us, and not writable by anybody else, so that nobody else can
+ * have swapped in its contents. */
+bool
+ds_cache_trusted(const char *path, const struct stat *st)
+{
+    if ((st->st_uid != 0 && st->st_uid != geteuid()) ||
+        (st->st_mode & (S_IWGRP | S_IWOTH))) {
+	ds_printf(DS_LEV_DEBUG, "ds_cache_trusted: %s is not trusted, owned by uid %ju with mode %04o",
+	          path, (uintmax_t)st->st_uid, (unsigned)(st->st_mode & 07777));
+	return false;
+    }
+
+    return true;
+}
+
+const struct ar_member *
+checkSigExist(struct deb_archive *deb, const char *name)
 {
     char buf[16];
 
     if (name == NULL) {
 	ds_printf(DS_LEV_DEBUG, "checkSigExist: NULL values passed");
-	return 0;
+	return NULL;
     }
 
     snprintf(buf, sizeof(buf) - 1, "_gpg%s", name);
 
     return findMember(deb, buf);
 }
+
+/* FNV-1a, good enough for the small tables we keep. */
+unsigned int
+ds_hash_key(const void *key, size_t len)
+{
+    const unsigned char *p = key;
+    unsigned int hash = 2166136261U;
+
+    while (len--) {
+	hash ^= *p++;
+	hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+void
+ds_hash_init(struct ds_hash *h)
+{
+    h->size = 64;
+    h->count = 0;
+    h->buckets = m_malloc(h->size * sizeof(*h->buckets));
+    memset(h->buckets, 0, h->size * sizeof(*h->buckets));
+}
+
+static void
+ds_hash_grow(struct ds_hash *h)
+{
+    struct ds_hash_entry **buckets;
+    size_t size = h->size * 2;
+    size_t i;
+
+    buckets = m_malloc(size * sizeof(*buckets));
+    memset(buckets, 0, size * sizeof(*buckets));
+
+    for (i = 0; i < h->size; i++) {
+	struct ds_hash_entry *e, *next;
+
+	for (e = h->buckets[i]; e; e = next) {
+	    next = e->next;
+	    e->next = buckets[e->hash & (size - 1)];
+	    buckets[e->hash & (size - 1)] = e;
+	}
+    }
+
+    free(h->buckets);
+    h->buckets = buckets;
+    h->size = size;
+}
+
+void *
+ds_hash_get(const struct ds_hash *h, const void *key, size_t len)
+{
+    unsigned int hash = ds_hash_key(key, len);
+    struct ds_hash_entry *e;
+
+    for (e = h->buckets[hash & (h->size - 1)]; e; e = e->next)
+	if (e->hash == hash && e->len == len && memcmp(e->key, key, len) == 0)
+	    return e->value;
+
+    return NULL;
+}
+
+/* Insert a value, the key is not copied and must outlive the table. An
+ * already present key is left untouched, so the first insertion wins. */
+void
+ds_hash_put(struct ds_hash *h, const void *key, size_t len, void *value)
+{
+    struct ds_hash_entry *e;
+
+    if (ds_hash_get(h, key, len))
+	return;
+
+    if (h->count >= h->size)
+	ds_hash_grow(h);
+
+    e = m_malloc(sizeof(*e));
+    e->hash = ds_hash_key(key, len);
+    e->key = key;
+    e->len = len;
+    e->value = value;
+    e->next = h->buckets[e->hash & (h->size - 1)];
+    h->buckets[e->hash & (h->size - 1)] = e;
+    h->count++;
+}
+
+void
+ds_hash_destroy(struct ds_hash *h)
+{
+    size_t i;
+
+    for (i = 0; i < h->size; i++) {
+	struct ds_hash_entry *e, *next;
+
+	for (e = h->buckets[i]; e; e = next) {
+	    next = e->next;
+	    free(e);
+	}
+    }
+
+    free(h->buckets);
+    h->buckets = NULL;
+    h->size = h->count = 0;
+}
+
+#define obstack_chunk_alloc m_malloc
+#define obstack_chunk_free free
+
+void
+ds_strtab_init(struct ds_strtab *tab)
+{
+    obstack_init(&tab->obs);
+    ds_hash_init(&tab->index);
+}
+
+/* Get the single copy of a string kept in the table. */
+char *
+ds_strtab_intern(struct ds_strtab *tab, const char *str)
+{
+    size_t len = strlen(str);
+    char *copy;
+
+    copy = ds_hash_get(&tab->index, str, len);
+    if (copy)
+	return copy;
+
+    copy = obstack_copy0(&tab->obs, str, len);
+    ds_hash_put(&tab->index, copy, len, copy);
+
+    return copy;
+}
+
+void
+ds_strtab_destroy(struct ds_strtab *tab)
+{
+    ds_hash_destroy(&tab->index);
+    obstack_free(&tab->obs, NULL);
+}
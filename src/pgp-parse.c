@@ -0,0 +1,474 @@
+/*
+ * debsig-verify - Debian package signature verification tool
+ *
+ * Copyright © 2026 Guillem Jover <guillem@debian.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * routines to parse OpenPGP packets (RFC 4880) natively
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dpkg/dpkg.h>
+
+#include "debsig.h"
+
+#define ARMOR_BEGIN "-----BEGIN PGP "
+#define ARMOR_END "-----END PGP "
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int
+base64_value(int c)
+{
+    if (c >= 'A' && c <= 'Z')
+	return c - 'A';
+    if (c >= 'a' && c <= 'z')
+	return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+	return c - '0' + 52;
+    if (c == '+')
+	return 62;
+    if (c == '/')
+	return 63;
+    return -1;
+}
+
+static const char *
+next_line(const char *p, const char *end)
+{
+    const char *nl = memchr(p, '\n', end - p);
+
+    return nl ? nl + 1 : end;
+}
+
+/* Decode an ASCII armored block into a newly allocated buffer. We do not
+ * check the armor CRC, as the packets carry their own integrity checks
+ * where it matters (the signature itself). */
+int
+pgp_dearmor(const char *text, size_t len, uint8_t **out, size_t *out_len)
+{
+    const char *p = text, *end = text + len;
+    uint8_t *buf;
+    size_t n = 0;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    /* Find the armor header line. */
+    while (p < end && strncmp(p, ARMOR_BEGIN, strlen(ARMOR_BEGIN)) != 0)
+	p = next_line(p, end);
+    if (p == end)
+	return PGP_ERR_MALFORMED;
+    p = next_line(p, end);
+
+    /* Skip the armor headers, up to the empty line. */
+    while (p < end && *p != '\n' && *p != '\r')
+	p = next_line(p, end);
+    if (p == end)
+	return PGP_ERR_MALFORMED;
+    p = next_line(p, end);
+
+    buf = m_malloc(len / 4 * 3 + 3);
+
+    for (; p < end; p = next_line(p, end)) {
+	const char *c;
+
+	if (*p == '=' || strncmp(p, ARMOR_END, strlen(ARMOR_END)) == 0)
+	    break;
+
+	for (c = p; c < end && *c != '\n'; c++) {
+	    int v;
+
+	    if (*c == '\r' || *c == ' ' || *c == '\t')
+		continue;
+	    if (*c == '=')
+		break;
+	    v = base64_value((unsigned char)*c);
+	    if (v < 0) {
+		free(buf);
+		return PGP_ERR_MALFORMED;
+	    }
+	    acc = (acc << 6) | v;
+	    bits += 6;
+	    if (bits >= 8) {
+		bits -= 8;
+		buf[n++] = (acc >> bits) & 0xff;
+	    }
+	}
+    }
+
+    *out = buf;
+    *out_len = n;
+
+    return PGP_OK;
+}
+
+/* Take the next packet out of the buffer, returning its tag and body.
+ * Partial body lengths are only used for data packets, which we never
+ * need to look into, so they are rejected. */
+int
+pgp_packet_next(const uint8_t **data, size_t *len,
+                int *tag, const uint8_t **body, size_t *body_len)
+{
+    const uint8_t *p = *data;
+    size_t left = *len;
+    size_t plen;
+    uint8_t ptag;
+
+    if (left == 0)
+	return PGP_ERR_END;
+
+    ptag = *p++;
+    left--;
+    if (!(ptag & 0x80))
+	return PGP_ERR_MALFORMED;
+
+    if (ptag & 0x40) {
+	/* New format packet. */
+	*tag = ptag & 0x3f;
+	if (left < 1)
+	    return PGP_ERR_MALFORMED;
+	if (p[0] < 192) {
+	    plen = p[0];
+	    p++, left--;
+	} else if (p[0] < 224) {
+	    if (left < 2)
+		return PGP_ERR_MALFORMED;
+	    plen = ((p[0] - 192) << 8) + p[1] + 192;
+	    p += 2, left -= 2;
+	} else if (p[0] == 255) {
+	    if (left < 5)
+		return PGP_ERR_MALFORMED;
+	    plen = get_be32(p + 1);
+	    p += 5, left -= 5;
+	} else {
+	    return PGP_ERR_UNSUPPORTED;
+	}
+    } else {
+	/* Old format packet. */
+	*tag = (ptag >> 2) & 0x0f;
+	switch (ptag & 0x03) {
+	case 0:
+	    if (left < 1)
+		return PGP_ERR_MALFORMED;
+	    plen = p[0];
+	    p++, left--;
+	    break;
+	case 1:
+	    if (left < 2)
+		return PGP_ERR_MALFORMED;
+	    plen = (p[0] << 8) | p[1];
+	    p += 2, left -= 2;
+	    break;
+	case 2:
+	    if (left < 4)
+		return PGP_ERR_MALFORMED;
+	    plen = get_be32(p);
+	    p += 4, left -= 4;
+	    break;
+	default:
+	    plen = left;
+	    break;
+	}
+    }
+
+    if (plen > left)
+	return PGP_ERR_MALFORMED;
+
+    *body = p;
+    *body_len = plen;
+    *data = p + plen;
+    *len = left - plen;
+
+    return PGP_OK;
+}
+
+/* Whether a subpacket type is one we either handle or can safely ignore,
+ * even when marked as critical. */
+static bool
+pgp_subpacket_known(int type)
+{
+    switch (type) {
+    case PGP_SUBPKT_CREATION_TIME:
+    case PGP_SUBPKT_SIG_EXPIRATION:
+    case PGP_SUBPKT_KEY_EXPIRATION:
+    case PGP_SUBPKT_ISSUER:
+    case PGP_SUBPKT_KEY_FLAGS:
+    case PGP_SUBPKT_EMBEDDED_SIG:
+    case PGP_SUBPKT_ISSUER_FPR:
+    case 4: /* Exportable. */
+    case 5: /* Trust signature. */
+    case 6: /* Regular expression. */
+    case 7: /* Revocable. */
+    case 11: /* Preferred symmetric algorithms. */
+    case 12: /* Revocation key, see keyring_index(). */
+    case 21: /* Preferred hash algorithms. */
+    case 22: /* Preferred compression algorithms. */
+    case 23: /* Key server preferences. */
+    case 24: /* Preferred key server. */
+    case 25: /* Primary user ID. */
+    case 26: /* Policy URI. */
+    case 28: /* Signer user ID. */
+    case 29: /* Reason for revocation. */
+    case 30: /* Features. */
+    case 31: /* Signature target. */
+	return true;
+    default:
+	return false;
+    }
+}
+
+static int
+pgp_parse_subpackets(const uint8_t *p, size_t len, struct pgp_sig *sig,
+                     bool hashed)
+{
+    while (len > 0) {
+	size_t sublen;
+	int type;
+
+	if (p[0] < 192) {
+	    sublen = p[0];
+	    p++, len--;
+	} else if (p[0] < 255) {
+	    if (len < 2)
+		return PGP_ERR_MALFORMED;
+	    sublen = ((p[0] - 192) << 8) + p[1] + 192;
+	    p += 2, len -= 2;
+	} else {
+	    if (len < 5)
+		return PGP_ERR_MALFORMED;
+	    sublen = get_be32(p + 1);
+	    p += 5, len -= 5;
+	}
+	if (sublen == 0 || sublen > len)
+	    return PGP_ERR_MALFORMED;
+
+	type = p[0] & 0x7f;
+	if (hashed && (p[0] & 0x80) && !pgp_subpacket_known(type))
+	    sig->critical_unknown = true;
+
+	switch (type) {
+	case PGP_SUBPKT_CREATION_TIME:
+	    /* Only trust the creation time from the hashed area. */
+	    if (hashed && sublen == 5)
+		sig->created = get_be32(p + 1);
+	    break;
+	case PGP_SUBPKT_SIG_EXPIRATION:
+	    if (hashed && sublen == 5)
+		sig->expires = get_be32(p + 1);
+	    break;
+	case PGP_SUBPKT_KEY_EXPIRATION:
+	    if (hashed && sublen == 5)
+		sig->key_expires = get_be32(p + 1);
+	    break;
+	case PGP_SUBPKT_KEY_FLAGS:
+	    if (hashed && sublen >= 2)
+		sig->key_flags = p[1];
+	    break;
+	case PGP_SUBPKT_EMBEDDED_SIG:
+	    /* The back signature is signed on its own, so it does not
+	     * matter which area it comes from. */
+	    sig->embedded = p + 1;
+	    sig->embedded_len = sublen - 1;
+	    break;
+	case PGP_SUBPKT_ISSUER:
+	    if (sublen == 9) {
+		memcpy(sig->keyid, p + 1, sizeof(sig->keyid));
+		sig->has_keyid = true;
+	    }
+	    break;
+	case PGP_SUBPKT_ISSUER_FPR:
+	    if (sublen == 22 && p[1] == 4) {
+		sig->fpr_len = 20;
+		memcpy(sig->fpr, p + 2, sig->fpr_len);
+	    } else if (sublen == 34 && p[1] == 5) {
+		sig->fpr_len = 32;
+		memcpy(sig->fpr, p + 2, sig->fpr_len);
+	    }
+	    break;
+	default:
+	    break;
+	}
+
+	p += sublen;
+	len -= sublen;
+    }
+
+    return PGP_OK;
+}
+
+/* Parse a signature packet body, which the signature keeps pointing into,
+ * so it must outlive it. */
+int
+pgp_parse_sig_packet(const uint8_t *p, size_t len, struct pgp_sig *sig)
+{
+    const uint8_t *start = p;
+    size_t sublen;
+    int rc;
+
+    memset(sig, 0, sizeof(*sig));
+    sig->key_flags = -1;
+    sig->packet = p;
+    sig->packet_len = len;
+
+    if (len < 1)
+	return PGP_ERR_MALFORMED;
+    sig->version = p[0];
+
+    if (sig->version == 3 || sig->version == 2) {
+	/* Version, hashed length (always 5), class, creation time, issuer
+	 * key ID, public key algorithm, hash algorithm. */
+	if (len < 19 || p[1] != 5)
+	    return PGP_ERR_MALFORMED;
+	sig->sig_class = p[2];
+	sig->created = get_be32(p + 3);
+	memcpy(sig->keyid, p + 7, sizeof(sig->keyid));
+	sig->has_keyid = true;
+	sig->pubkey_algo = p[15];
+	sig->hash_algo = p[16];
+	memcpy(sig->left16, p + 17, sizeof(sig->left16));
+	sig->hashed_off = 2;
+	sig->hashed_len = 5;
+	sig->mpi_off = 19;
+	return PGP_OK;
+    }
+
+    if (sig->version != 4)
+	return PGP_ERR_UNSUPPORTED;
+
+    if (len < 6)
+	return PGP_ERR_MALFORMED;
+    sig->sig_class = p[1];
+    sig->pubkey_algo = p[2];
+    sig->hash_algo = p[3];
+
+    sublen = (p[4] << 8) | p[5];
+    p += 6, len -= 6;
+    if (sublen > len)
+	return PGP_ERR_MALFORMED;
+    rc = pgp_parse_subpackets(p, sublen, sig, true);
+    if (rc < 0)
+	return rc;
+    p += sublen, len -= sublen;
+    sig->hashed_off = 0;
+    sig->hashed_len = p - start;
+
+    if (len < 2)
+	return PGP_ERR_MALFORMED;
+    sublen = (p[0] << 8) | p[1];
+    p += 2, len -= 2;
+    if (sublen > len)
+	return PGP_ERR_MALFORMED;
+    rc = pgp_parse_subpackets(p, sublen, sig, false);
+    if (rc < 0)
+	return rc;
+    p += sublen, len -= sublen;
+
+    if (len < 2)
+	return PGP_ERR_MALFORMED;
+    memcpy(sig->left16, p, sizeof(sig->left16));
+    sig->mpi_off = p + 2 - start;
+
+    /* Newer signatures might only carry the issuer fingerprint. */
+    if (!sig->has_keyid && sig->fpr_len == 20) {
+	memcpy(sig->keyid, sig->fpr + 12, sizeof(sig->keyid));
+	sig->has_keyid = true;
+    } else if (!sig->has_keyid && sig->fpr_len == 32) {
+	memcpy(sig->keyid, sig->fpr, sizeof(sig->keyid));
+	sig->has_keyid = true;
+    }
+
+    return PGP_OK;
+}
+
+/* Parse the first signature packet found in a detached signature, which
+ * might be either binary or ASCII armored. On success, the signature must
+ * be released with pgp_sig_destroy(). */
+int
+pgp_parse_sig(const void *data, size_t len, struct pgp_sig *sig)
+{
+    const uint8_t *p = data;
+    uint8_t *dearmored = NULL;
+    int rc;
+
+    if (len >= strlen(ARMOR_BEGIN) && !(p[0] & 0x80)) {
+	size_t dlen;
+
+	rc = pgp_dearmor(data, len, &dearmored, &dlen);
+	if (rc < 0)
+	    return rc;
+	p = dearmored;
+	len = dlen;
+    }
+
+    for (;;) {
+	const uint8_t *body;
+	size_t body_len;
+	int tag;
+
+	rc = pgp_packet_next(&p, &len, &tag, &body, &body_len);
+	if (rc == PGP_ERR_END)
+	    rc = PGP_ERR_MALFORMED;
+	if (rc < 0)
+	    break;
+
+	if (tag == PGP_PKT_SIGNATURE) {
+	    uint8_t *packet;
+
+	    /* Keep the packet around for verification. */
+	    packet = m_malloc(body_len);
+	    memcpy(packet, body, body_len);
+	    rc = pgp_parse_sig_packet(packet, body_len, sig);
+	    if (rc != PGP_OK) {
+		free(packet);
+		sig->packet = NULL;
+	    }
+	    break;
+	}
+    }
+
+    free(dearmored);
+
+    return rc;
+}
+
+void
+pgp_sig_destroy(struct pgp_sig *sig)
+{
+    free((void *)sig->packet);
+    sig->packet = NULL;
+}
+
+void
+pgp_keyid_str(const uint8_t *keyid, char *buf)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+	sprintf(buf + i * 2, "%02X", keyid[i]);
+}
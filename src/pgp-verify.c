@@ -0,0 +1,609 @@
+/*
+ * debsig-verify - Debian package signature verification tool
+ *
+ * Copyright © 2026 Guillem Jover <guillem@debian.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * verifies OpenPGP signatures in-process, via libgcrypt
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gcrypt.h>
+
+#include <dpkg/dpkg.h>
+
+#include "debsig.h"
+
+#define PGP_PK_RSA 1
+#define PGP_PK_RSA_SIGN 3
+#define PGP_PK_DSA 17
+#define PGP_PK_ECDSA 19
+#define PGP_PK_EDDSA 22
+
+/* The payload digest of a package, with one hash context per algorithm
+ * used by any of its signatures, all fed from a single pass over the
+ * signed data. */
+struct deb_digest {
+    gcry_md_hd_t md;
+};
+
+static const struct pgp_hash {
+    int algo;
+    int gcry_algo;
+    const char *name;
+} pgp_hashes[] = {
+    { 2, GCRY_MD_SHA1, "sha1" },
+    { 3, GCRY_MD_RMD160, "rmd160" },
+    { 8, GCRY_MD_SHA256, "sha256" },
+    { 9, GCRY_MD_SHA384, "sha384" },
+    { 10, GCRY_MD_SHA512, "sha512" },
+    { 11, GCRY_MD_SHA224, "sha224" },
+    { 0, 0, NULL },
+};
+
+static const struct pgp_curve {
+    const char *name;
+    size_t order_len;
+    size_t oid_len;
+    const uint8_t oid[10];
+} pgp_curves[] = {
+    { "NIST P-256", 32, 8,
+      { 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 } },
+    { "NIST P-384", 48, 5, { 0x2b, 0x81, 0x04, 0x00, 0x22 } },
+    { "NIST P-521", 66, 5, { 0x2b, 0x81, 0x04, 0x00, 0x23 } },
+    { "brainpoolP256r1", 32, 9,
+      { 0x2b, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x07 } },
+    { "brainpoolP384r1", 48, 9,
+      { 0x2b, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x0b } },
+    { "brainpoolP512r1", 64, 9,
+      { 0x2b, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x0d } },
+    { "secp256k1", 32, 5, { 0x2b, 0x81, 0x04, 0x00, 0x0a } },
+    { "Ed25519", 32, 9,
+      { 0x2b, 0x06, 0x01, 0x04, 0x01, 0xda, 0x47, 0x0f, 0x01 } },
+    { NULL, 0, 0, { 0 } },
+};
+
+static const struct pgp_hash *
+pgp_hash_find(int algo)
+{
+    const struct pgp_hash *hash;
+
+    for (hash = pgp_hashes; hash->name; hash++)
+	if (hash->algo == algo)
+	    return hash;
+
+    return NULL;
+}
+
+static int
+pgp_read_mpi(const uint8_t **p, size_t *len,
+             const uint8_t **mpi, size_t *mpi_len)
+{
+    size_t bits, bytes;
+
+    if (*len < 2)
+	return PGP_ERR_MALFORMED;
+    bits = ((*p)[0] << 8) | (*p)[1];
+    bytes = (bits + 7) / 8;
+    if (*len - 2 < bytes)
+	return PGP_ERR_MALFORMED;
+
+    *mpi = *p + 2;
+    *mpi_len = bytes;
+    *p += 2 + bytes;
+    *len -= 2 + bytes;
+
+    return PGP_OK;
+}
+
+static const struct pgp_curve *
+pgp_read_curve(const uint8_t **p, size_t *len)
+{
+    const struct pgp_curve *curve;
+    size_t oid_len;
+
+    if (*len < 1)
+	return NULL;
+    oid_len = (*p)[0];
+    if (oid_len == 0 || oid_len == 0xff || *len - 1 < oid_len)
+	return NULL;
+
+    for (curve = pgp_curves; curve->name; curve++) {
+	if (curve->oid_len == oid_len &&
+	    memcmp(curve->oid, *p + 1, oid_len) == 0) {
+	    *p += 1 + oid_len;
+	    *len -= 1 + oid_len;
+	    return curve;
+	}
+    }
+
+    return NULL;
+}
+
+/* Left pad an EdDSA signature value, which is stored as an MPI and so
+ * might have lost its leading zero octets. */
+static int
+pgp_pad_mpi(uint8_t *buf, size_t size, const uint8_t *mpi, size_t mpi_len)
+{
+    if (mpi_len > size)
+	return PGP_ERR_MALFORMED;
+    memset(buf, 0, size - mpi_len);
+    memcpy(buf + size - mpi_len, mpi, mpi_len);
+
+    return PGP_OK;
+}
+
+static int
+pgp_build_sexps(const struct pgp_key *key, const struct pgp_sig *sig,
+                const struct pgp_hash *hash, const uint8_t *digest,
+                size_t digest_len,
+                gcry_sexp_t *s_key, gcry_sexp_t *s_sig, gcry_sexp_t *s_data)
+{
+    const uint8_t *k = key->material, *s = sig->packet + sig->mpi_off;
+    size_t klen = key->material_len, slen = sig->packet_len - sig->mpi_off;
+    const uint8_t *m[4], *r, *v;
+    size_t mlen[4], rlen, vlen;
+    const struct pgp_curve *curve;
+    gcry_error_t gerr;
+    int i;
+
+    switch (key->pubkey_algo) {
+    case PGP_PK_RSA:
+    case PGP_PK_RSA_SIGN:
+	for (i = 0; i < 2; i++)
+	    if (pgp_read_mpi(&k, &klen, &m[i], &mlen[i]) < 0)
+		return PGP_ERR_MALFORMED;
+	if (pgp_read_mpi(&s, &slen, &v, &vlen) < 0)
+	    return PGP_ERR_MALFORMED;
+
+	gerr = gcry_sexp_build(s_key, NULL, "(public-key (rsa (n %b) (e %b)))",
+	                       (int)mlen[0], m[0], (int)mlen[1], m[1]);
+	if (!gerr)
+	    gerr = gcry_sexp_build(s_sig, NULL, "(sig-val (rsa (s %b)))",
+	                           (int)vlen, v);
+	if (!gerr)
+	    gerr = gcry_sexp_build(s_data, NULL,
+	                           "(data (flags pkcs1) (hash %s %b))",
+	                           hash->name, (int)digest_len, digest);
+	break;
+    case PGP_PK_DSA:
+	for (i = 0; i < 4; i++)
+	    if (pgp_read_mpi(&k, &klen, &m[i], &mlen[i]) < 0)
+		return PGP_ERR_MALFORMED;
+	if (pgp_read_mpi(&s, &slen, &r, &rlen) < 0 ||
+	    pgp_read_mpi(&s, &slen, &v, &vlen) < 0)
+	    return PGP_ERR_MALFORMED;
+
+	gerr = gcry_sexp_build(s_key, NULL,
+	                       "(public-key (dsa (p %b) (q %b) (g %b) (y %b)))",
+	                       (int)mlen[0], m[0], (int)mlen[1], m[1],
+	                       (int)mlen[2], m[2], (int)mlen[3], m[3]);
+	if (!gerr)
+	    gerr = gcry_sexp_build(s_sig, NULL, "(sig-val (dsa (r %b) (s %b)))",
+	                           (int)rlen, r, (int)vlen, v);
+	/* The digest gets truncated to the size of q (DSA2). */
+	if (digest_len > mlen[1])
+	    digest_len = mlen[1];
+	if (!gerr)
+	    gerr = gcry_sexp_build(s_data, NULL, "(data (flags raw) (value %b))",
+	                           (int)digest_len, digest);
+	break;
+    case PGP_PK_ECDSA:
+	curve = pgp_read_curve(&k, &klen);
+	if (curve == NULL || strcmp(curve->name, "Ed25519") == 0)
+	    return PGP_ERR_UNSUPPORTED;
+	if (pgp_read_mpi(&k, &klen, &m[0], &mlen[0]) < 0)
+	    return PGP_ERR_MALFORMED;
+	if (pgp_read_mpi(&s, &slen, &r, &rlen) < 0 ||
+	    pgp_read_mpi(&s, &slen, &v, &vlen) < 0)
+	    return PGP_ERR_MALFORMED;
+
+	gerr = gcry_sexp_build(s_key, NULL,
+	                       "(public-key (ecc (curve %s) (q %b)))",
+	                       curve->name, (int)mlen[0], m[0]);
+	if (!gerr)
+	    gerr = gcry_sexp_build(s_sig, NULL, "(sig-val (ecdsa (r %b) (s %b)))",
+	                           (int)rlen, r, (int)vlen, v);
+	/* The digest gets truncated to the size of the curve order. */
+	if (digest_len > curve->order_len)
+	    digest_len = curve->order_len;
+	if (!gerr)
+	    gerr = gcry_sexp_build(s_data, NULL, "(data (flags raw) (value %b))",
+	                           (int)digest_len, digest);
+	break;
+    case PGP_PK_EDDSA: {
+	uint8_t rbuf[32], sbuf[32];
+
+	curve = pgp_read_curve(&k, &klen);
+	if (curve == NULL || strcmp(curve->name, "Ed25519") != 0)
+	    return PGP_ERR_UNSUPPORTED;
+	if (pgp_read_mpi(&k, &klen, &m[0], &mlen[0]) < 0)
+	    return PGP_ERR_MALFORMED;
+	/* Strip the native point format prefix. */
+	if (mlen[0] == 33 && m[0][0] == 0x40)
+	    m[0]++, mlen[0]--;
+	if (pgp_read_mpi(&s, &slen, &r, &rlen) < 0 ||
+	    pgp_read_mpi(&s, &slen, &v, &vlen) < 0 ||
+	    pgp_pad_mpi(rbuf, sizeof(rbuf), r, rlen) < 0 ||
+	    pgp_pad_mpi(sbuf, sizeof(sbuf), v, vlen) < 0)
+	    return PGP_ERR_MALFORMED;
+
+	gerr = gcry_sexp_build(s_key, NULL,
+	                       "(public-key (ecc (curve Ed25519) (flags eddsa) (q %b)))",
+	                       (int)mlen[0], m[0]);
+	if (!gerr)
+	    gerr = gcry_sexp_build(s_sig, NULL, "(sig-val (eddsa (r %b) (s %b)))",
+	                           (int)sizeof(rbuf), rbuf,
+	                           (int)sizeof(sbuf), sbuf);
+	if (!gerr)
+	    gerr = gcry_sexp_build(s_data, NULL,
+	                           "(data (flags eddsa) (hash-algo sha512) (value %b))",
+	                           (int)digest_len, digest);
+	break;
+    }
+    default:
+	return PGP_ERR_UNSUPPORTED;
+    }
+
+    if (gerr) {
+	ds_printf(DS_LEV_DEBUG, "pgpVerify: cannot build key material: %s",
+	          gcry_strerror(gerr));
+	return PGP_ERR_MALFORMED;
+    }
+
+    return PGP_OK;
+}
+
+static int
+digest_write(const void *buf, size_t len, void *data, struct dpkg_error *err)
+{
+    gcry_md_hd_t md = data;
+
+    gcry_md_write(md, buf, len);
+
+    return 0;
+}
+
+/* Hash the signed data of the package once, with every algorithm used by
+ * any of its signatures, so that each signature check only needs to hash
+ * its own trailer on top of a copy of these contexts. */
+static struct deb_digest *
+deb_digest_get(struct deb_archive *deb, const struct pgp_hash *want)
+{
+    struct deb_digest *digest;
+    struct dpkg_error err;
+    int i;
+
+    if (deb->stream) {
+	/* The payload got hashed as it went past, unless it was not in the
+	 * usual order, in which case it gets hashed again from the copy. */
+	if (deb_archive_stream_hashed(deb) &&
+	    gcry_md_is_enabled(deb->digest->md, want->gcry_algo))
+	    return deb->digest;
+	deb_digest_free(deb->digest);
+	deb->digest = NULL;
+	deb->stream = false;
+    }
+
+    if (deb->digest) {
+	if (!gcry_md_is_enabled(deb->digest->md, want->gcry_algo))
+	    internerr("hash algorithm %s not enabled in package digest",
+	              want->name);
+	return deb->digest;
+    }
+
+    digest = m_malloc(sizeof(*digest));
+    if (gcry_md_open(&digest->md, want->gcry_algo, 0))
+	ohshit("cannot initialize %s digest", want->name);
+
+    for (i = 0; i < deb->nsigs; i++) {
+	const struct pgp_hash *hash;
+
+	if (deb->sigs[i].status != PGP_OK)
+	    continue;
+
+	hash = pgp_hash_find(deb->sigs[i].sig.hash_algo);
+	if (hash)
+	    gcry_md_enable(digest->md, hash->gcry_algo);
+    }
+
+    if (readSignedData(deb, digest_write, digest->md, &err) < 0)
+	ohshit("deb_digest_get: cannot hash signed data: %s", err.str);
+
+    deb->digest = digest;
+
+    return digest;
+}
+
+/* A digest with every algorithm we support, for the payload of streams. */
+struct deb_digest *
+deb_digest_new(void)
+{
+    const struct pgp_hash *hash;
+    struct deb_digest *digest;
+
+    pgp_crypto_init();
+
+    digest = m_malloc(sizeof(*digest));
+    if (gcry_md_open(&digest->md, 0, 0))
+	ohshit("cannot initialize package digest");
+    for (hash = pgp_hashes; hash->name; hash++)
+	if (gcry_md_test_algo(hash->gcry_algo) == 0)
+	    gcry_md_enable(digest->md, hash->gcry_algo);
+
+    return digest;
+}
+
+void
+deb_digest_write(struct deb_digest *digest, const void *buf, size_t len)
+{
+    gcry_md_write(digest->md, buf, len);
+}
+
+void
+deb_digest_free(struct deb_digest *digest)
+{
+    if (digest == NULL)
+	return;
+
+    gcry_md_close(digest->md);
+    free(digest);
+}
+
+/* Finish the digest of what a signature covers with its own trailer, and
+ * check the signature against it, closing the digest. */
+static int
+pgp_check_digest(gcry_md_hd_t md, const struct pgp_hash *hash,
+                 const struct pgp_key *key, const struct pgp_sig *sig)
+{
+    gcry_sexp_t s_key = NULL, s_sig = NULL, s_data = NULL;
+    gcry_error_t gerr;
+    uint8_t trailer[6];
+    const uint8_t *value;
+    size_t value_len;
+    int rc;
+
+    gcry_md_write(md, sig->packet + sig->hashed_off, sig->hashed_len);
+    if (sig->version == 4) {
+	trailer[0] = 4;
+	trailer[1] = 0xff;
+	trailer[2] = (sig->hashed_len >> 24) & 0xff;
+	trailer[3] = (sig->hashed_len >> 16) & 0xff;
+	trailer[4] = (sig->hashed_len >> 8) & 0xff;
+	trailer[5] = sig->hashed_len & 0xff;
+	gcry_md_write(md, trailer, sizeof(trailer));
+    }
+
+    value = gcry_md_read(md, hash->gcry_algo);
+    value_len = gcry_md_get_algo_dlen(hash->gcry_algo);
+
+    /* Quick check, before going for the expensive public key operation. */
+    if (memcmp(value, sig->left16, sizeof(sig->left16)) != 0) {
+	ds_printf(DS_LEV_DEBUG, "pgpVerify: digest prefix mismatch");
+	gcry_md_close(md);
+	return 0;
+    }
+
+    rc = pgp_build_sexps(key, sig, hash, value, value_len,
+                         &s_key, &s_sig, &s_data);
+    gcry_md_close(md);
+    if (rc == PGP_OK) {
+	gerr = gcry_pk_verify(s_sig, s_data, s_key);
+	if (gerr)
+	    ds_printf(DS_LEV_DEBUG, "pgpVerify: %s", gcry_strerror(gerr));
+	rc = gerr ? 0 : 1;
+    } else if (rc == PGP_ERR_MALFORMED) {
+	rc = 0;
+    }
+
+    gcry_sexp_release(s_key);
+    gcry_sexp_release(s_sig);
+    gcry_sexp_release(s_data);
+
+    return rc;
+}
+
+static int
+pgp_check_sig(struct deb_archive *deb, const struct pgp_key *key,
+              const struct pgp_sig *sig)
+{
+    const struct pgp_hash *hash;
+    struct deb_digest *digest;
+    gcry_md_hd_t md;
+
+    hash = pgp_hash_find(sig->hash_algo);
+    if (hash == NULL) {
+	ds_printf(DS_LEV_DEBUG, "pgpVerify: unsupported hash algorithm %d",
+	          sig->hash_algo);
+	return PGP_ERR_UNSUPPORTED;
+    }
+
+    digest = deb_digest_get(deb, hash);
+    if (gcry_md_copy(&md, digest->md))
+	ohshit("cannot copy %s digest", hash->name);
+
+    return pgp_check_digest(md, hash, key, sig);
+}
+
+static void
+pgp_hash_key(gcry_md_hd_t md, const struct pgp_key *key)
+{
+    uint8_t hdr[5];
+    size_t len = key->packet_len;
+
+    if (key->version == 5) {
+	hdr[0] = 0x9a;
+	hdr[1] = (len >> 24) & 0xff;
+	hdr[2] = (len >> 16) & 0xff;
+	hdr[3] = (len >> 8) & 0xff;
+	hdr[4] = len & 0xff;
+	gcry_md_write(md, hdr, 5);
+    } else {
+	hdr[0] = 0x99;
+	hdr[1] = (len >> 8) & 0xff;
+	hdr[2] = len & 0xff;
+	gcry_md_write(md, hdr, 3);
+    }
+    gcry_md_write(md, key->packet, len);
+}
+
+/* Check a signature made by signer over a key, and either one of its
+ * subkeys or one of its user IDs, as the signature class requires.
+ * Returns 1 if the signature is good, 0 if it is not, and -1 if it uses
+ * something we do not support. */
+int
+pgp_check_key_sig(const struct pgp_key *signer, const struct pgp_sig *sig,
+                  const struct pgp_key *key, const struct pgp_key *subkey,
+                  const uint8_t *uid, size_t uid_len)
+{
+    const struct pgp_hash *hash;
+    gcry_md_hd_t md;
+    int rc;
+
+    if (sig->critical_unknown)
+	return -1;
+    if (signer->pubkey_algo != sig->pubkey_algo)
+	return 0;
+
+    hash = pgp_hash_find(sig->hash_algo);
+    if (hash == NULL)
+	return -1;
+
+    pgp_crypto_init();
+
+    if (gcry_md_open(&md, hash->gcry_algo, 0))
+	ohshit("cannot initialize %s digest", hash->name);
+
+    pgp_hash_key(md, key);
+    if ((sig->sig_class >= PGP_SIG_CERT_GENERIC &&
+         sig->sig_class <= PGP_SIG_CERT_POSITIVE) ||
+        sig->sig_class == PGP_SIG_CERT_REVOCATION) {
+	if (uid == NULL)
+	    internerr("user ID signature class %#x without a user ID",
+	              sig->sig_class);
+	/* Only version 4 signatures frame the user ID. */
+	if (sig->version == 4) {
+	    uint8_t hdr[5];
+
+	    hdr[0] = 0xb4;
+	    hdr[1] = (uid_len >> 24) & 0xff;
+	    hdr[2] = (uid_len >> 16) & 0xff;
+	    hdr[3] = (uid_len >> 8) & 0xff;
+	    hdr[4] = uid_len & 0xff;
+	    gcry_md_write(md, hdr, sizeof(hdr));
+	}
+	gcry_md_write(md, uid, uid_len);
+    } else if (subkey) {
+	pgp_hash_key(md, subkey);
+    }
+
+    rc = pgp_check_digest(md, hash, signer, sig);
+
+    return rc < 0 ? -1 : rc;
+}
+
+/* Verify a signature member against the keyring of a match, without
+ * running gpg. Returns 1 if the signature is good, 0 if it is not, and
+ * -1 if the signature or the keyring use something we do not support,
+ * in which case the caller should try the gpg backend instead. */
+int
+pgpVerify(struct debsig_ctx *ctx, const char *originID,
+          const struct match *mtc, struct deb_archive *deb,
+          const struct ar_member *mem)
+{
+    const struct keyring *kr;
+    const struct pgp_key *key;
+    const struct deb_sig *ds;
+    const struct pgp_sig *sig;
+    char *keyring;
+    time_t now;
+    int rc, status;
+
+    pgp_crypto_init();
+
+    ds = getSig(deb, mem);
+    if (ds == NULL || ds->status == PGP_ERR_UNSUPPORTED)
+	return -1;
+    if (ds->status < 0)
+	return 0;
+    sig = &ds->sig;
+
+    if (sig->sig_class != PGP_SIG_BINARY || !sig->has_keyid) {
+	ds_printf(DS_LEV_DEBUG, "pgpVerify: unsupported signature class %#x",
+	          sig->sig_class);
+	return -1;
+    }
+    if (sig->critical_unknown) {
+	ds_printf(DS_LEV_DEBUG, "pgpVerify: unknown critical subpacket");
+	return -1;
+    }
+
+    keyring = ds_keyring_path(ctx, originID, mtc->file);
+    kr = keyring_get(ctx, keyring, &status);
+    free(keyring);
+    if (kr == NULL || status != PGP_OK)
+	return status == PGP_ERR_UNSUPPORTED ? -1 : 0;
+
+    key = keyring_find_keyid(kr, sig->keyid);
+    if (key == NULL) {
+	ds_printf(DS_LEV_DEBUG, "pgpVerify: no key %s in %s", ds->keyid,
+	          mtc->file);
+	return 0;
+    }
+    if (sig->fpr_len &&
+        (sig->fpr_len != key->fpr_len ||
+         memcmp(sig->fpr, key->fpr, sig->fpr_len) != 0)) {
+	ds_printf(DS_LEV_DEBUG, "pgpVerify: issuer fingerprint mismatch for %s",
+	          key->keyid_str);
+	return 0;
+    }
+    if (key->pubkey_algo != sig->pubkey_algo) {
+	ds_printf(DS_LEV_DEBUG, "pgpVerify: key %s algorithm mismatch",
+	          key->keyid_str);
+	return 0;
+    }
+    now = time(NULL);
+    rc = keyring_key_usable(key, now);
+    if (rc <= 0)
+	return rc;
+    if (sig->expires && sig->created + sig->expires <= now) {
+	ds_printf(DS_LEV_DEBUG, "pgpVerify: signature from key %s expired",
+	          key->keyid_str);
+	return 0;
+    }
+    if (sig->created < key->created) {
+	ds_printf(DS_LEV_DEBUG, "pgpVerify: signature older than key %s",
+	          key->keyid_str);
+	return 0;
+    }
+
+    rc = pgp_check_sig(deb, key, sig);
+    if (rc < 0)
+	return -1;
+
+    ds_printf(DS_LEV_DEBUG, "pgpVerify: %s signature from key %s",
+              rc ? "good" : "bad", key->keyid_str);
+
+    return rc;
+}
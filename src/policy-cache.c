@@ -0,0 +1,710 @@
+/*
+ * debsig-verify - Debian package signature verification tool
+ *
+ * Copyright © 2026 Guillem Jover <guillem@debian.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * compiles the policy files of an origin into a single binary image, which
+ * gets mapped instead of parsing the XML files while they are unchanged
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <obstack.h>
+
+#include <dpkg/dpkg.h>
+#include <dpkg/fdio.h>
+
+#include "debsig.h"
+
+#define obstack_chunk_alloc m_malloc
+#define obstack_chunk_free free
+
+/*
+ * The image is made of a header, followed by the file, group and match
+ * arrays, and the string table. Strings are referenced by their offset in
+ * the table, where 0 stands for no string, and groups and matches by their
+ * index in their arrays. The image is only meant for the host that built
+ * it, so everything is stored in native byte order.
+ */
+
+#define PCACHE_MAGIC "DSPC"
+#define PCACHE_VERSION 2
+
+struct pcache_header {
+    char magic[4];
+    uint32_t version;
+    /* The identity of the policy directory when it got compiled, which
+     * changes whenever policy files are added, removed or renamed. */
+    uint64_t dir_dev;
+    uint64_t dir_ino;
+    int64_t dir_mtime_sec;
+    int64_t dir_mtime_nsec;
+    uint32_t dir;
+    uint32_t nfiles;
+    uint32_t ngroups;
+    uint32_t nmatches;
+    uint32_t strings_len;
+    uint32_t pad;
+};
+
+struct pcache_file {
+    uint32_t name;
+    /* Whether the file parsed correctly, if not it is kept to be skipped
+     * just like a parse failure would. */
+    uint32_t valid;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint32_t pol_name;
+    uint32_t pol_id;
+    uint32_t pol_description;
+    uint32_t sels;
+    uint32_t nsels;
+    uint32_t vers;
+    uint32_t nvers;
+    uint32_t pad;
+};
+
+struct pcache_group {
+    uint32_t matches;
+    uint32_t nmatches;
+    int32_t min_opt;
+};
+
+struct pcache_match {
+    int32_t type;
+    uint32_t name;
+    uint32_t file;
+    uint32_t id;
+    int32_t day_expiry;
+};
+
+struct pcache_image {
+    const struct pcache_header *hdr;
+    const struct pcache_file *files;
+    const struct pcache_group *groups;
+    const struct pcache_match *matches;
+    const char *strings;
+};
+
+static char *
+pcache_path(const struct debsig_ctx *ctx, const char *originID)
+{
+    char *path;
+
+    m_asprintf(&path, "%s%s/%s", ctx->rootdir, ctx->cache_dir, originID);
+
+    return path;
+}
+
+static void
+pcache_image_get(const struct origin_policies *op, struct pcache_image *img)
+{
+    const uint8_t *p = op->image;
+
+    img->hdr = (const struct pcache_header *)p;
+    p += sizeof(*img->hdr);
+    img->files = (const struct pcache_file *)p;
+    p += img->hdr->nfiles * sizeof(*img->files);
+    img->groups = (const struct pcache_group *)p;
+    p += img->hdr->ngroups * sizeof(*img->groups);
+    img->matches = (const struct pcache_match *)p;
+    p += img->hdr->nmatches * sizeof(*img->matches);
+    img->strings = (const char *)p;
+}
+
+static const char *
+pcache_str(const struct pcache_image *img, uint32_t off)
+{
+    return off ? img->strings + off : NULL;
+}
+
+static bool
+pcache_range_ok(uint32_t first, uint32_t count, uint32_t max)
+{
+    return first <= max && count <= max - first;
+}
+
+/* Check that everything in the image stays within its bounds, so that
+ * the rest of the code can use it as is. */
+static bool
+pcache_image_check(const uint8_t *data, size_t len)
+{
+    const struct pcache_header *hdr = (const struct pcache_header *)data;
+    struct origin_policies op;
+    struct pcache_image img;
+    uint64_t size;
+    uint32_t i, n;
+
+    if (len < sizeof(*hdr) || memcmp(hdr->magic, PCACHE_MAGIC, 4) != 0 ||
+        hdr->version != PCACHE_VERSION)
+	return false;
+
+    size = sizeof(*hdr) +
+           (uint64_t)hdr->nfiles * sizeof(struct pcache_file) +
+           (uint64_t)hdr->ngroups * sizeof(struct pcache_group) +
+           (uint64_t)hdr->nmatches * sizeof(struct pcache_match) +
+           hdr->strings_len;
+    if (size != len || hdr->nfiles > INT32_MAX || hdr->strings_len == 0)
+	return false;
+
+    op.image = data;
+    op.image_len = len;
+    pcache_image_get(&op, &img);
+
+    n = hdr->strings_len;
+    if (img.strings[0] != '\0' || img.strings[n - 1] != '\0')
+	return false;
+    if (hdr->dir == 0 || hdr->dir >= n)
+	return false;
+
+    for (i = 0; i < hdr->nfiles; i++) {
+	const struct pcache_file *f = &img.files[i];
+
+	if (f->name == 0 || f->name >= n || f->pol_name >= n ||
+	    f->pol_id >= n || f->pol_description >= n)
+	    return false;
+	if (!pcache_range_ok(f->sels, f->nsels, hdr->ngroups) ||
+	    !pcache_range_ok(f->vers, f->nvers, hdr->ngroups))
+	    return false;
+    }
+    for (i = 0; i < hdr->ngroups; i++) {
+	const struct pcache_group *g = &img.groups[i];
+
+	if (!pcache_range_ok(g->matches, g->nmatches, hdr->nmatches))
+	    return false;
+    }
+    for (i = 0; i < hdr->nmatches; i++) {
+	const struct pcache_match *m = &img.matches[i];
+
+	if (m->name >= n || m->file >= n || m->id >= n)
+	    return false;
+    }
+
+    return true;
+}
+
+static bool
+pcache_stat_matches(const struct stat *st, int64_t sec, int64_t nsec)
+{
+    return st->st_mtim.tv_sec == sec && st->st_mtim.tv_nsec == nsec;
+}
+
+/* Check whether the image still describes the policy directory, and each
+ * of its policy files. */
+static bool
+pcache_image_fresh(const struct origin_policies *op,
+                   const struct pcache_image *img)
+{
+    const struct pcache_header *hdr = img->hdr;
+    struct stat st;
+    uint32_t i;
+
+    if (strcmp(pcache_str(img, hdr->dir), op->dir) != 0)
+	return false;
+    if (stat(op->dir, &st) < 0 || hdr->dir_dev != st.st_dev ||
+        hdr->dir_ino != st.st_ino ||
+        !pcache_stat_matches(&st, hdr->dir_mtime_sec, hdr->dir_mtime_nsec))
+	return false;
+
+    for (i = 0; i < hdr->nfiles; i++) {
+	const struct pcache_file *f = &img->files[i];
+	char *pol_file;
+	int rc;
+
+	m_asprintf(&pol_file, "%s/%s", op->dir, pcache_str(img, f->name));
+	rc = stat(pol_file, &st);
+	free(pol_file);
+	if (rc < 0 || !S_ISREG(st.st_mode) || st.st_size != f->size ||
+	    !pcache_stat_matches(&st, f->mtime_sec, f->mtime_nsec))
+	    return false;
+    }
+
+    return true;
+}
+
+/* Map the compiled image of an origin, if there is one and it is up to
+ * date, and take the list of policy files from it. The image stands in for
+ * the policies, so it only gets used if nobody but root or us can have
+ * written it, or swapped it in its directory. */
+bool
+policy_cache_load(struct debsig_ctx *ctx, struct origin_policies *op)
+{
+    struct pcache_image img;
+    struct stat st;
+    char *cache, *path;
+    void *map;
+    uint32_t i;
+    int fd;
+
+    m_asprintf(&cache, "%s%s", ctx->rootdir, ctx->cache_dir);
+    if (stat(cache, &st) < 0 || !S_ISDIR(st.st_mode) ||
+        !ds_cache_trusted(cache, &st)) {
+	free(cache);
+	return false;
+    }
+    free(cache);
+
+    path = pcache_path(ctx, op->originID);
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+	ds_printf(DS_LEV_DEBUG, "policy_cache_load: no compiled policies %s: %s",
+	          path, strerror(errno));
+	free(path);
+	return false;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        !ds_cache_trusted(path, &st)) {
+	close(fd);
+	free(path);
+	return false;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	free(path);
+	return false;
+    }
+
+    if (!pcache_image_check(map, st.st_size)) {
+	ds_printf(DS_LEV_DEBUG, "policy_cache_load: %s is not a valid image",
+	          path);
+	munmap(map, st.st_size);
+	free(path);
+	return false;
+    }
+
+    op->image = map;
+    op->image_len = st.st_size;
+    pcache_image_get(op, &img);
+
+    if (!pcache_image_fresh(op, &img)) {
+	ds_printf(DS_LEV_DEBUG, "policy_cache_load: %s is out of date", path);
+	policy_cache_unmap(op);
+	free(path);
+	return false;
+    }
+
+    ds_printf(DS_LEV_DEBUG, "policy_cache_load: using compiled policies %s",
+              path);
+    free(path);
+
+    /* The identity checked is the one the image got compiled from, which
+     * is what the resident policies describe. */
+    op->dir_dev = img.hdr->dir_dev;
+    op->dir_ino = img.hdr->dir_ino;
+    op->dir_mtime.tv_sec = img.hdr->dir_mtime_sec;
+    op->dir_mtime.tv_nsec = img.hdr->dir_mtime_nsec;
+    op->nfiles = img.hdr->nfiles;
+    op->files = m_malloc(op->nfiles * sizeof(*op->files));
+    op->stamps = m_malloc(op->nfiles * sizeof(*op->stamps) + 1);
+    for (i = 0; i < img.hdr->nfiles; i++) {
+	op->files[i] = m_strdup(pcache_str(&img, img.files[i].name));
+	op->stamps[i].size = img.files[i].size;
+	op->stamps[i].mtime.tv_sec = img.files[i].mtime_sec;
+	op->stamps[i].mtime.tv_nsec = img.files[i].mtime_nsec;
+    }
+
+    return true;
+}
+
+void
+policy_cache_unmap(struct origin_policies *op)
+{
+    if (op->image == NULL)
+	return;
+
+    munmap((void *)op->image, op->image_len);
+    op->image = NULL;
+    op->image_len = 0;
+}
+
+static struct group *
+pcache_groups_get(struct obstack *obs, const struct pcache_image *img,
+                  uint32_t first, uint32_t count)
+{
+    struct group *grps;
+    uint32_t i, j;
+
+    if (count == 0)
+	return NULL;
+
+    grps = obstack_alloc(obs, count * sizeof(*grps));
+    memset(grps, 0, count * sizeof(*grps));
+
+    for (i = 0; i < count; i++) {
+	const struct pcache_group *pg = &img->groups[first + i];
+	struct group *grp = &grps[i];
+
+	grp->min_opt = pg->min_opt;
+	grp->nmatches = pg->nmatches;
+	if (pg->nmatches == 0)
+	    continue;
+	grp->matches = obstack_alloc(obs, pg->nmatches * sizeof(*grp->matches));
+	memset(grp->matches, 0, pg->nmatches * sizeof(*grp->matches));
+
+	for (j = 0; j < pg->nmatches; j++) {
+	    const struct pcache_match *pm = &img->matches[pg->matches + j];
+	    struct match *mtc = &grp->matches[j];
+
+	    mtc->type = pm->type;
+	    /* The strings stay in the mapping, and are never modified. */
+	    mtc->name = (char *)pcache_str(img, pm->name);
+	    mtc->file = (char *)pcache_str(img, pm->file);
+	    mtc->id = (char *)pcache_str(img, pm->id);
+	    mtc->day_expiry = pm->day_expiry;
+	}
+    }
+
+    return grps;
+}
+
+/* Get policy number i of a compiled image, as parsePolicyFile() would
+ * have returned it. The policy refers to the image, and must be released
+ * before unmapping it. */
+struct policy *
+policy_cache_get(struct origin_policies *op, int i, bool selection_only)
+{
+    struct pcache_image img;
+    const struct pcache_file *f;
+    struct policy *pol;
+
+    pcache_image_get(op, &img);
+    f = &img.files[i];
+    if (!f->valid) {
+	ds_printf(DS_LEV_DEBUG, "    policy_cache_get: %s did not parse",
+	          pcache_str(&img, f->name));
+	return NULL;
+    }
+
+    pol = m_malloc(sizeof(*pol));
+    memset(pol, 0, sizeof(*pol));
+    obstack_init(&pol->obs);
+    pol->name = (char *)pcache_str(&img, f->pol_name);
+    pol->id = (char *)pcache_str(&img, f->pol_id);
+    pol->description = (char *)pcache_str(&img, f->pol_description);
+    pol->sels = pcache_groups_get(&pol->obs, &img, f->sels, f->nsels);
+    pol->nsels = f->nsels;
+    if (selection_only) {
+	pol->partial = true;
+    } else {
+	pol->vers = pcache_groups_get(&pol->obs, &img, f->vers, f->nvers);
+	pol->nvers = f->nvers;
+    }
+
+    return pol;
+}
+
+/* An image being built, with its strings interned. */
+struct pcache_builder {
+    struct pcache_file *files;
+    struct pcache_group *groups;
+    struct pcache_match *matches;
+    char *strings;
+    size_t nfiles, ngroups, nmatches, strings_len;
+    size_t groups_alloc, matches_alloc, strings_alloc;
+    struct ds_hash interned;
+};
+
+static uint32_t
+pcache_intern(struct pcache_builder *pb, const char *str)
+{
+    size_t len, off;
+    void *found;
+
+    if (str == NULL)
+	return 0;
+
+    len = strlen(str);
+    found = ds_hash_get(&pb->interned, str, len);
+    if (found)
+	return (uintptr_t)found;
+
+    if (pb->strings_len + len + 1 > UINT32_MAX)
+	ohshit("compiled policies are too large");
+    if (pb->strings_len + len + 1 > pb->strings_alloc) {
+	while (pb->strings_len + len + 1 > pb->strings_alloc)
+	    pb->strings_alloc = pb->strings_alloc ? pb->strings_alloc * 2 : 1024;
+	pb->strings = m_realloc(pb->strings, pb->strings_alloc);
+    }
+    off = pb->strings_len;
+    memcpy(pb->strings + off, str, len + 1);
+    pb->strings_len += len + 1;
+
+    /* The key has to outlive the table, so it cannot point into the
+     * string table, which can get moved. */
+    ds_hash_put(&pb->interned, str, len, (void *)(uintptr_t)off);
+
+    return off;
+}
+
+static void
+pcache_add_groups(struct pcache_builder *pb, const struct group *grps,
+                  int ngrps, uint32_t *first, uint32_t *count)
+{
+    int i, j;
+
+    if (pb->ngroups + ngrps > pb->groups_alloc) {
+	while (pb->ngroups + ngrps > pb->groups_alloc)
+	    pb->groups_alloc = pb->groups_alloc ? pb->groups_alloc * 2 : 16;
+	pb->groups = m_realloc(pb->groups,
+	                       pb->groups_alloc * sizeof(*pb->groups));
+    }
+
+    *first = pb->ngroups;
+    *count = ngrps;
+
+    for (i = 0; i < ngrps; i++) {
+	const struct group *g = &grps[i];
+	struct pcache_group *pg = &pb->groups[pb->ngroups++];
+
+	memset(pg, 0, sizeof(*pg));
+	pg->min_opt = g->min_opt;
+	pg->matches = pb->nmatches;
+	pg->nmatches = g->nmatches;
+
+	if (pb->nmatches + g->nmatches > pb->matches_alloc) {
+	    while (pb->nmatches + g->nmatches > pb->matches_alloc)
+		pb->matches_alloc = pb->matches_alloc ? pb->matches_alloc * 2 : 32;
+	    pb->matches = m_realloc(pb->matches,
+	                            pb->matches_alloc * sizeof(*pb->matches));
+	}
+
+	for (j = 0; j < g->nmatches; j++) {
+	    const struct match *m = &g->matches[j];
+	    struct pcache_match *pm = &pb->matches[pb->nmatches++];
+
+	    memset(pm, 0, sizeof(*pm));
+	    pm->type = m->type;
+	    pm->name = pcache_intern(pb, m->name);
+	    pm->file = pcache_intern(pb, m->file);
+	    pm->id = pcache_intern(pb, m->id);
+	    pm->day_expiry = m->day_expiry;
+	}
+    }
+}
+
+static int
+pcache_write(const char *path, const struct pcache_header *hdr,
+             const struct pcache_builder *pb)
+{
+    char *tmp;
+    int fd;
+
+    m_asprintf(&tmp, "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+	ds_printf(DS_LEV_ERR, "cannot create %s: %s", tmp, strerror(errno));
+	free(tmp);
+	return -1;
+    }
+
+    if (fchmod(fd, 0644) < 0 ||
+        fd_write(fd, hdr, sizeof(*hdr)) < 0 ||
+        fd_write(fd, pb->files, pb->nfiles * sizeof(*pb->files)) < 0 ||
+        fd_write(fd, pb->groups, pb->ngroups * sizeof(*pb->groups)) < 0 ||
+        fd_write(fd, pb->matches, pb->nmatches * sizeof(*pb->matches)) < 0 ||
+        fd_write(fd, pb->strings, pb->strings_len) < 0 ||
+        fsync(fd) < 0 || close(fd) < 0) {
+	ds_printf(DS_LEV_ERR, "cannot write %s: %s", tmp, strerror(errno));
+	close(fd);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+    }
+
+    /* Replace the image atomically, as it can be in use. */
+    if (rename(tmp, path) < 0) {
+	ds_printf(DS_LEV_ERR, "cannot rename %s to %s: %s", tmp, path,
+	          strerror(errno));
+	unlink(tmp);
+	free(tmp);
+	return -1;
+    }
+    free(tmp);
+
+    return 0;
+}
+
+/* Compile the policy files of an origin into its image in the cache
+ * directory. */
+int
+policy_cache_compile(struct debsig_ctx *ctx, const char *originID)
+{
+    struct origin_policies op;
+    struct pcache_builder pb;
+    struct pcache_header hdr;
+    struct policy **pols;
+    struct ds_strtab strings;
+    char *path;
+    int i, rc;
+
+    memset(&op, 0, sizeof(op));
+    m_asprintf(&op.dir, "%s%s/%s", ctx->rootdir, ctx->policies_dir,
+               originID);
+
+    /* The scan takes the identity of the directory and the files before
+     * reading them, so that any change made meanwhile leaves the image
+     * stale. */
+    origin_policies_scan(&op);
+    if (op.err) {
+	ds_printf(DS_LEV_ERR, "cannot read %s: %s", op.dir, strerror(op.err));
+	free(op.dir);
+	return -1;
+    }
+
+    memset(&pb, 0, sizeof(pb));
+    ds_hash_init(&pb.interned);
+    /* Offset 0 stands for no string. */
+    pb.strings = m_malloc(1);
+    pb.strings[0] = '\0';
+    pb.strings_len = pb.strings_alloc = 1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PCACHE_MAGIC, 4);
+    hdr.version = PCACHE_VERSION;
+    hdr.dir_dev = op.dir_dev;
+    hdr.dir_ino = op.dir_ino;
+    hdr.dir_mtime_sec = op.dir_mtime.tv_sec;
+    hdr.dir_mtime_nsec = op.dir_mtime.tv_nsec;
+    hdr.dir = pcache_intern(&pb, op.dir);
+
+    ds_strtab_init(&strings);
+    pb.nfiles = op.nfiles;
+    pb.files = m_malloc(op.nfiles * sizeof(*pb.files) + 1);
+    pols = m_malloc(op.nfiles * sizeof(*pols) + 1);
+
+    for (i = 0; i < op.nfiles; i++) {
+	struct pcache_file *f = &pb.files[i];
+	char *pol_file;
+
+	memset(f, 0, sizeof(*f));
+	f->name = pcache_intern(&pb, op.files[i]);
+
+	f->mtime_sec = op.stamps[i].mtime.tv_sec;
+	f->mtime_nsec = op.stamps[i].mtime.tv_nsec;
+	f->size = op.stamps[i].size;
+
+	m_asprintf(&pol_file, "%s/%s", op.dir, op.files[i]);
+	ds_printf(DS_LEV_VER, "  Compiling policy file: %s", pol_file);
+	pols[i] = parsePolicyFile(pol_file, &strings, false);
+	free(pol_file);
+	if (pols[i] == NULL)
+	    continue;
+
+	f->valid = 1;
+	f->pol_name = pcache_intern(&pb, pols[i]->name);
+	f->pol_id = pcache_intern(&pb, pols[i]->id);
+	f->pol_description = pcache_intern(&pb, pols[i]->description);
+	pcache_add_groups(&pb, pols[i]->sels, pols[i]->nsels,
+	                  &f->sels, &f->nsels);
+	pcache_add_groups(&pb, pols[i]->vers, pols[i]->nvers,
+	                  &f->vers, &f->nvers);
+    }
+
+    hdr.nfiles = pb.nfiles;
+    hdr.ngroups = pb.ngroups;
+    hdr.nmatches = pb.nmatches;
+    hdr.strings_len = pb.strings_len;
+
+    path = pcache_path(ctx, originID);
+    rc = pcache_write(path, &hdr, &pb);
+    if (rc == 0)
+	ds_printf(DS_LEV_INFO, "Compiled %d policies of %s into %s",
+	          op.nfiles, originID, path);
+    free(path);
+
+    /* The interned keys point into the policy strings, so drop them first. */
+    ds_hash_destroy(&pb.interned);
+    for (i = 0; i < op.nfiles; i++) {
+	policy_free(pols[i]);
+	free(op.files[i]);
+    }
+    free(pols);
+    ds_strtab_destroy(&strings);
+    free(op.files);
+    free(op.stamps);
+    free(op.dir);
+    free(pb.files);
+    free(pb.groups);
+    free(pb.matches);
+    free(pb.strings);
+
+    return rc;
+}
+
+/* Compile the policies of every origin in the policies directory. */
+int
+policy_cache_compile_all(struct debsig_ctx *ctx)
+{
+    struct dirent *ent;
+    char *policies, *cache;
+    DIR *dir;
+    int rc = 0;
+
+    /* The directory only gets trusted with these permissions, whatever
+     * the umask. */
+    m_asprintf(&cache, "%s%s", ctx->rootdir, ctx->cache_dir);
+    if (mkdir(cache, 0755) == 0 ? chmod(cache, 0755) < 0 : errno != EEXIST) {
+	ds_printf(DS_LEV_ERR, "cannot create %s: %s", cache, strerror(errno));
+	free(cache);
+	return -1;
+    }
+    free(cache);
+
+    m_asprintf(&policies, "%s%s", ctx->rootdir, ctx->policies_dir);
+    dir = opendir(policies);
+    if (dir == NULL) {
+	ds_printf(DS_LEV_ERR, "cannot open %s: %s", policies, strerror(errno));
+	free(policies);
+	return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+	struct stat st;
+	char *origin;
+	int is_dir;
+
+	if (ent->d_name[0] == '.')
+	    continue;
+
+	m_asprintf(&origin, "%s/%s", policies, ent->d_name);
+	is_dir = stat(origin, &st) == 0 && S_ISDIR(st.st_mode);
+	free(origin);
+	if (!is_dir)
+	    continue;
+
+	if (policy_cache_compile(ctx, ent->d_name) < 0)
+	    rc = -1;
+    }
+    closedir(dir);
+    free(policies);
+
+    return rc;
+}
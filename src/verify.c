@@ -0,0 +1,854 @@
+/*
+ * debsig-verify - Debian package signature verification tool
+ *
+ * Copyright © 2000 Ben Collins <bcollins@debian.org>
+ * Copyright © 2014-2016, 2018 Guillem Jover <guillem@debian.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * package verification against the origin policies
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <dpkg/dpkg.h>
+#include <dpkg/string.h>
+#include <dpkg/path.h>
+
+#include "debsig.h"
+
+#define CTAR(x) "control.tar" # x
+#define DTAR(x) "data.tar" # x
+static const char ver_magic_member[] = "debian-binary";
+static const char *ver_ctrl_members[] = {
+	CTAR(), CTAR(.gz), CTAR(.xz), NULL
+};
+static const char *ver_data_members[] = {
+	DTAR(), DTAR(.gz), DTAR(.xz), DTAR(.bz2), DTAR(.lzma), NULL
+};
+
+/* Check that the key ID of a match is the one of its signature. */
+static int
+checkKeyID(struct debsig_ctx *ctx, struct deb_archive *deb,
+           const char *originID, const struct match *mtc)
+{
+    const char *m_id = getKeyID(ctx, originID, mtc);
+    const char *d_id = getSigKeyID(ctx, deb, mtc->name);
+
+    return m_id != NULL && d_id != NULL && strcmp(m_id, d_id) == 0;
+}
+
+/* Intern a signature type for a context, returning -1 if there are too
+ * many different ones to fit in a mask. */
+static int
+sigTypeIntern(struct debsig_ctx *ctx, const char *name)
+{
+    void *found;
+    int type;
+
+    if (ctx->sig_types.buckets == NULL)
+	ds_hash_init(&ctx->sig_types);
+
+    found = ds_hash_get(&ctx->sig_types, name, strlen(name));
+    if (found)
+	return (intptr_t)found - 1;
+
+    if (ctx->nsig_types == SIG_TYPES_MAX)
+	return -1;
+
+    type = ctx->nsig_types++;
+    ctx->sig_type_names[type] = m_strdup(name);
+    ds_hash_put(&ctx->sig_types, ctx->sig_type_names[type], strlen(name),
+                (void *)(intptr_t)(type + 1));
+
+    return type;
+}
+
+void
+sig_types_free(struct debsig_ctx *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->nsig_types; i++)
+	free(ctx->sig_type_names[i]);
+    ctx->nsig_types = 0;
+    ds_hash_destroy(&ctx->sig_types);
+}
+
+/* Intern the signature types of the matches of a policy, and precompute
+ * the masks of each group. */
+static bool
+bindGroups(struct debsig_ctx *ctx, struct group *grps, int ngrps)
+{
+    int i, j;
+
+    for (i = 0; i < ngrps; i++) {
+	struct group *grp = &grps[i];
+
+	grp->required = grp->optional = grp->reject = grp->with_id = 0;
+	grp->opt_shared = false;
+
+	for (j = 0; j < grp->nmatches; j++) {
+	    struct match *mtc = &grp->matches[j];
+	    sig_mask_t bit;
+
+	    mtc->sig_type = sigTypeIntern(ctx, mtc->name);
+	    if (mtc->sig_type < 0)
+		return false;
+	    bit = SIG_TYPE_BIT(mtc->sig_type);
+
+	    switch (mtc->type) {
+	    case REQUIRED_MATCH:
+		grp->required |= bit;
+		break;
+	    case OPTIONAL_MATCH:
+		if (grp->optional & bit)
+		    grp->opt_shared = true;
+		grp->optional |= bit;
+		break;
+	    case REJECT_MATCH:
+		grp->reject |= bit;
+		break;
+	    }
+	    if (mtc->id)
+		grp->with_id |= bit;
+	}
+    }
+
+    return true;
+}
+
+static bool
+bindPolicy(struct debsig_ctx *ctx, struct policy *pol)
+{
+    if (pol->bound)
+	return true;
+
+    if (!bindGroups(ctx, pol->sels, pol->nsels) ||
+        !bindGroups(ctx, pol->vers, pol->nvers)) {
+	ds_printf(DS_LEV_ERR, "too many different signature types in policies, "
+	          "at most %d are supported", SIG_TYPES_MAX);
+	return false;
+    }
+    pol->bound = true;
+
+    return true;
+}
+
+/* Get the mask of the signature types present in a package, checking only
+ * the types interned since the last time. */
+static sig_mask_t
+sigPresent(struct debsig_ctx *ctx, struct deb_archive *deb)
+{
+    for (; deb->sig_types_checked < ctx->nsig_types; deb->sig_types_checked++) {
+	int type = deb->sig_types_checked;
+
+	if (checkSigExist(deb, ctx->sig_type_names[type]))
+	    deb->sig_present |= SIG_TYPE_BIT(type);
+    }
+
+    return deb->sig_present;
+}
+
+/* Check the presence rules of a group against the signatures of a package:
+ * every Required one must be there, no Reject one can be, any match with
+ * a key ID needs its signature, and enough Optional ones must be there. */
+static int
+checkGroupMasks(const struct group *grp, sig_mask_t present)
+{
+    int opt_count, i;
+
+    if ((grp->required & ~present) || (grp->reject & present) ||
+        (grp->with_id & ~present))
+	return 0;
+
+    if (grp->opt_shared) {
+	opt_count = 0;
+	for (i = 0; i < grp->nmatches; i++)
+	    if (grp->matches[i].type == OPTIONAL_MATCH &&
+	        (present & SIG_TYPE_BIT(grp->matches[i].sig_type)))
+		opt_count++;
+    } else {
+	opt_count = __builtin_popcountll(grp->optional & present);
+    }
+
+    if (opt_count < grp->min_opt) {
+	ds_printf(DS_LEV_DEBUG, "checkGroupMasks: opt passed - %d, opt required %d",
+	          opt_count, grp->min_opt);
+	return 0;
+    }
+
+    return 1;
+}
+
+/* Check the presence rules of every Selection group of a policy. */
+static bool
+checkSelMasks(const struct policy *pol, sig_mask_t present)
+{
+    int g;
+
+    for (g = 0; g < pol->nsels; g++)
+	if (!checkGroupMasks(&pol->sels[g], present))
+	    return false;
+
+    return true;
+}
+
+/* Check the key IDs named by the Selection groups of a policy, whose
+ * presence rules are already known to pass. */
+static int
+checkSelRules(struct debsig_ctx *ctx, struct deb_archive *deb,
+              const char *originID, const struct policy *pol)
+{
+    int g, i;
+
+    for (g = 0; g < pol->nsels; g++) {
+	const struct group *grp = &pol->sels[g];
+
+	for (i = 0; i < grp->nmatches; i++) {
+	    const struct match *mtc = &grp->matches[i];
+
+	    if (mtc->id == NULL)
+		continue;
+
+	    ds_printf(DS_LEV_VER, "      Processing '%s' key...", mtc->name);
+
+	    if (!checkKeyID(ctx, deb, originID, mtc))
+		return 0;
+	}
+    }
+
+    /* XXX: If the match doesn't specify an ID, we need to check to
+     * make sure the ID of the signature exists in the keyring
+     * specified, don't we?
+     */
+
+    return 1;
+}
+
+static int
+verifySigGpg(struct debsig_ctx *ctx, struct deb_archive *deb,
+             const char *originID, struct match *mtc,
+             const struct ar_member *mem)
+{
+    struct dpkg_error err;
+    char *tmp_sig;
+    int fd, valid;
+
+    /* let's get our temp file */
+    tmp_sig = path_make_temp_template("debsig-sig");
+    if ((fd = mkstemp(tmp_sig)) == -1) {
+	ds_printf(DS_LEV_ERR, "error creating temp file %s: %s\n",
+		  tmp_sig, strerror(errno));
+	free(tmp_sig);
+	return 0;
+    }
+
+    if (copyMember(deb, mem, fd, &err) < 0)
+	ohshit("verifySig: cannot copy to temp file: %s", err.str);
+
+    if (close(fd) < 0)
+	ohshit("error closing temp file %s", tmp_sig);
+
+    /* Now, let's check with gpg on this one, it gets the signed data
+     * streamed straight from the package. */
+    valid = gpgVerify(ctx, originID, mtc, deb, mem, tmp_sig);
+
+    unlink(tmp_sig);
+    free(tmp_sig);
+
+    return valid;
+}
+
+/* Check one signature member against the keyring of a match. The outcome
+ * is remembered in the package, so that when several groups refer to the
+ * same signature and keyring, it only gets checked once. */
+static int
+verifySig(struct debsig_ctx *ctx, struct deb_archive *deb,
+          const char *originID, struct match *mtc,
+          const struct ar_member *mem)
+{
+    struct sig_result *res;
+    int valid = -1;
+
+    for (res = deb->results; res; res = res->next) {
+	if (res->sig == mem && strcmp(res->file, mtc->file) == 0) {
+	    ds_printf(DS_LEV_DEBUG, "verifySig: reusing result for %s with %s",
+	              mem->name, mtc->file);
+	    return res->valid;
+	}
+    }
+
+    if (ctx->backend == DEBSIG_BACKEND_NATIVE) {
+	valid = pgpVerify(ctx, originID, mtc, deb, mem);
+	if (valid < 0)
+	    ds_printf(DS_LEV_DEBUG, "verifySig: cannot check %s natively, using gpg",
+	              mem->name);
+    }
+    if (valid < 0)
+	valid = verifySigGpg(ctx, deb, originID, mtc, mem);
+
+    res = m_malloc(sizeof(*res));
+    res->sig = mem;
+    res->file = m_strdup(mtc->file);
+    res->valid = valid;
+    res->next = deb->results;
+    deb->results = res;
+
+    return valid;
+}
+
+static int
+verifyGroupRules(struct debsig_ctx *ctx, struct deb_archive *deb,
+                 const char *originID, const struct group *grp)
+{
+    sig_mask_t present;
+    int i;
+
+    /* If we don't have any matches, we fail. We don't want blank,
+     * take-all rules. This actually gets checked while we parse the
+     * policy file, but we check again for good measure.  */
+    if (grp->nmatches == 0)
+	return 0;
+
+    present = sigPresent(ctx, deb);
+    if (!checkGroupMasks(grp, present))
+	return 0;
+
+    for (i = 0; i < grp->nmatches; i++) {
+	struct match *mtc = &grp->matches[i];
+	const struct ar_member *mem;
+
+	/* Optional signatures that are not there have nothing to check,
+	 * and the masks tell there are enough of the others. */
+	if (!(present & SIG_TYPE_BIT(mtc->sig_type)))
+	    continue;
+
+	ds_printf(DS_LEV_VER, "      Processing '%s' key...", mtc->name);
+
+	/* If we have an ID for this match, check to make sure it exists, and
+	 * matches the signature we are about to check.  */
+	if (mtc->id && !checkKeyID(ctx, deb, originID, mtc))
+	    return 0;
+
+	mem = checkSigExist(deb, mtc->name);
+
+	/* We fail no matter what now. Even if this is an optional match
+	 * rule, by now, we know that the sig exists, so we must fail */
+	if (!verifySig(ctx, deb, originID, mtc, mem)) {
+	    ds_printf(DS_LEV_DEBUG, "verifyGroupRules: failed for %s", mtc->name);
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+static int
+checkIsDeb(struct deb_archive *deb)
+{
+    int i;
+    const char *member;
+
+    deb->signed_members[0] = findMember(deb, ver_magic_member);
+    if (!deb->signed_members[0]) {
+       ds_printf(DS_LEV_VER, "Missing archive magic member %s", ver_magic_member);
+       return 0;
+    }
+
+    for (i = 0; (member = ver_ctrl_members[i]); i++)
+        if ((deb->signed_members[1] = findMember(deb, member)))
+            break;
+    if (!member) {
+        ds_printf(DS_LEV_VER, "Missing archive control member, checked:");
+        for (i = 0; (member = ver_ctrl_members[i]); i++)
+            ds_printf(DS_LEV_VER, "    %s", member);
+        return 0;
+    }
+
+    for (i = 0; (member = ver_data_members[i]); i++)
+        if ((deb->signed_members[2] = findMember(deb, member)))
+            break;
+    if (!member) {
+        ds_printf(DS_LEV_VER, "Missing archive data member, checked:");
+        for (i = 0; (member = ver_data_members[i]); i++)
+            ds_printf(DS_LEV_VER, "    %s", member);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+policy_name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Take the size and modification time of a policy file, or a size of -1
+ * if it cannot be stat'ed. */
+static void
+policy_stamp_get(const struct origin_policies *op, int i,
+                 struct policy_stamp *stamp)
+{
+    struct stat st;
+    char *pol_file;
+
+    m_asprintf(&pol_file, "%s/%s", op->dir, op->files[i]);
+    if (stat(pol_file, &st) == 0 && S_ISREG(st.st_mode)) {
+	stamp->size = st.st_size;
+	stamp->mtime = st.st_mtim;
+    } else {
+	memset(stamp, 0, sizeof(*stamp));
+	stamp->size = -1;
+    }
+    free(pol_file);
+}
+
+/* List the policy files in the directory of an origin, taking their
+ * identity before they get read, so that any change made meanwhile is
+ * noticed. */
+void
+origin_policies_scan(struct origin_policies *op)
+{
+    struct dirent *pd_ent;
+    struct stat st;
+    DIR *pd;
+    int i, nalloc = 0;
+
+    if (stat(op->dir, &st) < 0) {
+	op->err = errno;
+	return;
+    }
+    op->dir_dev = st.st_dev;
+    op->dir_ino = st.st_ino;
+    op->dir_mtime = st.st_mtim;
+
+    pd = opendir(op->dir);
+    if (pd == NULL) {
+	op->err = errno;
+	return;
+    }
+    while ((pd_ent = readdir(pd)) != NULL) {
+	/* Make sure we have the right name format */
+	if (!str_match_end(pd_ent->d_name, ".pol"))
+	    continue;
+
+	if (op->nfiles == nalloc) {
+	    nalloc = nalloc ? nalloc * 2 : 8;
+	    op->files = m_realloc(op->files, nalloc * sizeof(*op->files));
+	}
+	op->files[op->nfiles++] = m_strdup(pd_ent->d_name);
+    }
+    closedir(pd);
+
+    /* Policies are considered in name order, not in directory order. */
+    qsort(op->files, op->nfiles, sizeof(*op->files), policy_name_cmp);
+
+    op->stamps = m_malloc(op->nfiles * sizeof(*op->stamps) + 1);
+    for (i = 0; i < op->nfiles; i++)
+	policy_stamp_get(op, i, &op->stamps[i]);
+}
+
+/* Check whether the directory of an origin, or any of its policy files,
+ * changed since they got listed, including the directory showing up or
+ * going away. */
+static bool
+origin_policies_stale(const struct origin_policies *op)
+{
+    struct policy_stamp stamp;
+    struct stat st;
+    int i;
+
+    if (stat(op->dir, &st) < 0)
+	return errno != op->err;
+    if (op->err)
+	return true;
+    if (st.st_dev != op->dir_dev || st.st_ino != op->dir_ino ||
+        st.st_mtim.tv_sec != op->dir_mtime.tv_sec ||
+        st.st_mtim.tv_nsec != op->dir_mtime.tv_nsec)
+	return true;
+
+    for (i = 0; i < op->nfiles; i++) {
+	policy_stamp_get(op, i, &stamp);
+	if (stamp.size != op->stamps[i].size ||
+	    stamp.mtime.tv_sec != op->stamps[i].mtime.tv_sec ||
+	    stamp.mtime.tv_nsec != op->stamps[i].mtime.tv_nsec)
+	    return true;
+    }
+
+    return false;
+}
+
+static void
+origin_policies_free(struct origin_policies *op)
+{
+    int i;
+
+    /* The policies can point into the image, so release them first. */
+    for (i = 0; i < op->nfiles; i++) {
+	policy_free(op->pols[i]);
+	free(op->files[i]);
+    }
+    free(op->pols);
+    free(op->loaded);
+    while (op->decision_list) {
+	struct policy_decision *dec = op->decision_list;
+
+	op->decision_list = dec->next;
+	free(dec);
+    }
+    ds_hash_destroy(&op->decisions);
+    ds_strtab_destroy(&op->strings);
+    free(op->files);
+    free(op->stamps);
+    policy_cache_unmap(op);
+    free(op->dir);
+    free(op->originID);
+    free(op);
+}
+
+/* Get the policies of an origin, which stay resident for the next packages
+ * until the directory or any of the files change, checked once for each
+ * package. */
+static struct origin_policies *
+getOriginPolicies(struct debsig_ctx *ctx, const char *originID)
+{
+    struct origin_policies *op, **link;
+
+    for (link = &ctx->origins; (op = *link); link = &op->next) {
+	if (strcmp(op->originID, originID) != 0)
+	    continue;
+	if (op->checked == ctx->generation || !origin_policies_stale(op)) {
+	    op->checked = ctx->generation;
+	    return op;
+	}
+	ds_printf(DS_LEV_DEBUG, "getOriginPolicies: %s changed, reloading",
+	          op->dir);
+	*link = op->next;
+	origin_policies_free(op);
+	break;
+    }
+
+    op = m_malloc(sizeof(*op));
+    memset(op, 0, sizeof(*op));
+    op->originID = m_strdup(originID);
+    m_asprintf(&op->dir, "%s%s/%s", ctx->rootdir, ctx->policies_dir,
+               originID);
+    op->checked = ctx->generation;
+
+    if (!policy_cache_load(ctx, op))
+	origin_policies_scan(op);
+
+    op->pols = m_malloc(op->nfiles * sizeof(*op->pols) + 1);
+    memset(op->pols, 0, op->nfiles * sizeof(*op->pols));
+    op->loaded = m_malloc(op->nfiles * sizeof(*op->loaded) + 1);
+    memset(op->loaded, 0, op->nfiles * sizeof(*op->loaded));
+    ds_strtab_init(&op->strings);
+
+    op->next = ctx->origins;
+    ctx->origins = op;
+
+    return op;
+}
+
+static struct policy *
+loadOriginPolicy(struct debsig_ctx *ctx, struct origin_policies *op, int i,
+                 bool selection_only)
+{
+    struct policy *pol;
+    char *pol_file;
+
+    m_asprintf(&pol_file, "%s/%s", op->dir, op->files[i]);
+    if (op->image) {
+	ds_printf(DS_LEV_VER, "  Loading compiled policy file: %s", pol_file);
+	pol = policy_cache_get(op, i, selection_only);
+    } else {
+	ds_printf(DS_LEV_VER, "  Parsing policy file: %s", pol_file);
+	pol = parsePolicyFile(pol_file, &op->strings, selection_only);
+    }
+    free(pol_file);
+    if (pol && !bindPolicy(ctx, pol)) {
+	policy_free(pol);
+	pol = NULL;
+    }
+
+    return pol;
+}
+
+/* Get policy number i of an origin, loading it on first use, with its
+ * Origin and Selection blocks only. A policy that failed to load is not
+ * retried. */
+static const struct policy *
+getOriginPolicy(struct debsig_ctx *ctx, struct origin_policies *op, int i)
+{
+    if (op->loaded[i])
+	return op->pols[i];
+
+    op->pols[i] = loadOriginPolicy(ctx, op, i, true);
+    op->loaded[i] = true;
+
+    return op->pols[i];
+}
+
+/* Get policy number i of an origin with its Verification blocks too, for
+ * the policy that gets committed to. The complete policy replaces the
+ * partial one, or is dropped if it does not load. */
+static const struct policy *
+getOriginPolicyComplete(struct debsig_ctx *ctx, struct origin_policies *op,
+                        int i)
+{
+    struct policy *pol = op->pols[i];
+
+    if (pol == NULL || !pol->partial)
+	return pol;
+
+    policy_free(pol);
+    op->pols[i] = loadOriginPolicy(ctx, op, i, false);
+
+    return op->pols[i];
+}
+
+/* Find a policy of an origin by its file name. */
+static int
+findOriginPolicy(const struct origin_policies *op, const char *name)
+{
+    char *const *file;
+
+    file = bsearch(&name, op->files, op->nfiles, sizeof(*op->files),
+                   policy_name_cmp);
+
+    return file ? file - op->files : -1;
+}
+
+/* Get the policies of an origin whose Selection presence rules pass for
+ * the signatures of a package, in priority order. They are computed once
+ * for each set of signatures seen, from all the policies of the origin,
+ * so that selecting a policy does not need to go through each of them. */
+static const struct policy_decision *
+getPolicyDecision(struct debsig_ctx *ctx, struct origin_policies *op,
+                  struct deb_archive *deb)
+{
+    struct policy_decision *dec;
+    sig_mask_t present;
+    int i, g;
+
+    if (!op->indexed) {
+	ds_hash_init(&op->decisions);
+	op->sig_types = 0;
+	for (i = 0; i < op->nfiles; i++) {
+	    const struct policy *pol = getOriginPolicy(ctx, op, i);
+
+	    if (pol == NULL)
+		continue;
+	    for (g = 0; g < pol->nsels; g++)
+		op->sig_types |= pol->sels[g].required | pol->sels[g].optional |
+		                 pol->sels[g].reject | pol->sels[g].with_id;
+	}
+	op->indexed = true;
+    }
+
+    /* Only the signature types the policies care about tell packages
+     * apart. */
+    present = sigPresent(ctx, deb) & op->sig_types;
+    dec = ds_hash_get(&op->decisions, &present, sizeof(present));
+    if (dec)
+	return dec;
+
+    dec = m_malloc(sizeof(*dec) + op->nfiles * sizeof(dec->pols[0]));
+    dec->present = present;
+    dec->npols = 0;
+    for (i = 0; i < op->nfiles; i++)
+	if (op->pols[i] && checkSelMasks(op->pols[i], present))
+	    dec->pols[dec->npols++] = i;
+    dec->next = op->decision_list;
+    op->decision_list = dec;
+    ds_hash_put(&op->decisions, &dec->present, sizeof(dec->present), dec);
+
+    ds_printf(DS_LEV_DEBUG, "getPolicyDecision: %d of %d policies for signatures %#llx",
+              dec->npols, op->nfiles, (unsigned long long)present);
+
+    return dec;
+}
+
+void
+origin_cache_free(struct origin_policies *origins)
+{
+    struct origin_policies *op;
+
+    while ((op = origins)) {
+	origins = op->next;
+	origin_policies_free(op);
+    }
+}
+
+/* Run the whole verification procedure on one package, returning its
+ * exit class, and filling in what is known about the origin and the policy
+ * used. Internal errors are still reported with ohshit(). */
+int
+verifyDeb(struct debsig_ctx *ctx, struct deb_archive *deb,
+          const struct verify_opts *opts, struct debsig_result *res)
+{
+    struct origin_policies *op;
+    const struct policy *pol = NULL;
+    const char *originID;
+    char *pol_file = NULL;
+    const int *cands;
+    int forced, ncands = 0, nsels;
+    int i, g, k, usable = 0;
+    int rc = DS_SUCCESS;
+
+    if (!opts->list_only)
+	ds_printf(DS_LEV_VER, "Starting verification for: %s", deb->ar->name);
+
+    if (!checkIsDeb(deb))
+	ohshit("%s does not appear to be a deb format package", deb->ar->name);
+
+    originID = getSigKeyID(ctx, deb, "origin");
+    if (originID == NULL) {
+	ds_printf(DS_LEV_ERR, "Origin Signature check failed. This deb might not be signed.\n");
+	return DS_FAIL_NOSIGS;
+    }
+    res->origin = m_strdup(originID);
+
+    /* Now we have an ID, let's check the policy to use */
+    op = getOriginPolicies(ctx, originID);
+    if (op->err) {
+	ds_printf(DS_LEV_ERR, "Could not open Origin directory %s: %s\n",
+	          op->dir, strerror(op->err));
+	rc = DS_FAIL_UNKNOWN_ORIGIN;
+	goto out;
+    }
+
+    ds_printf(DS_LEV_VER, "Using policy directory: %s", op->dir);
+
+    if (opts->list_only)
+        ds_printf(DS_LEV_ALWAYS, "  Policies in: %s", op->dir);
+
+    /* Get the candidates from the index, or only the one asked for. */
+    if (opts->force_file != NULL) {
+	i = findOriginPolicy(op, opts->force_file);
+	if (i >= 0 && getOriginPolicy(ctx, op, i) &&
+	    checkSelMasks(op->pols[i], sigPresent(ctx, deb))) {
+	    forced = i;
+	    ncands = 1;
+	}
+	cands = &forced;
+    } else {
+	const struct policy_decision *dec = getPolicyDecision(ctx, op, deb);
+
+	cands = dec->pols;
+	ncands = dec->npols;
+    }
+
+    for (k = 0; k < ncands && (pol == NULL || opts->list_only); k++) {
+	const char *pol_name = op->files[cands[k]];
+
+	pol = op->pols[cands[k]];
+	if (pol == NULL)
+	    continue;
+
+	/* Now let's see if this policy's selection is useful for this .deb  */
+	ds_printf(DS_LEV_VER, "  Checking policy file: %s/%s", op->dir, pol_name);
+	ds_printf(DS_LEV_VER, "    Checking Selection group(s).");
+	/* The index was built from the screened policies, so check the masks
+	 * again, in case a policy got more Selection blocks when completed. */
+	if (!checkSelMasks(pol, sigPresent(ctx, deb)) ||
+	    !checkSelRules(ctx, deb, originID, pol)) {
+	    ds_printf(DS_LEV_VER, "    Selection group failed checks.");
+	    pol = NULL;
+	    continue;
+	}
+
+	/* Only now get the rest of the policy, which can turn out to be
+	 * unusable, or to have more Selection blocks than screened when
+	 * they come after the Verification ones. */
+	nsels = pol->nsels;
+	pol = getOriginPolicyComplete(ctx, op, cands[k]);
+	if (pol == NULL)
+	    continue;
+	if (pol->nsels != nsels &&
+	    !(checkSelMasks(pol, sigPresent(ctx, deb)) &&
+	      checkSelRules(ctx, deb, originID, pol))) {
+	    ds_printf(DS_LEV_VER, "    Selection group failed checks.");
+	    pol = NULL;
+	    continue;
+	}
+
+	if (opts->list_only) {
+	    ds_printf(DS_LEV_ALWAYS, "    Usable: %s", pol_name);
+	    usable++;
+	} else {
+	    ds_printf(DS_LEV_VER, "    Selection group(s) passed, policy is usable.");
+	    m_asprintf(&pol_file, "%s/%s", op->dir, pol_name);
+	}
+    }
+
+    if ((pol == NULL && !opts->list_only) || (opts->list_only && !usable)) {
+	/* Damn, can't verify this one */
+	ds_printf(DS_LEV_ERR, "No applicable policy found.");
+	rc = DS_FAIL_NOPOLICIES;
+	goto out;
+    }
+
+    if (opts->list_only)
+	goto out; /* our job is done */
+
+    ds_printf(DS_LEV_VER, "Using policy file: %s", pol_file);
+
+    res->policy = m_strdup(pol_file);
+    if (pol->name)
+	res->policy_name = m_strdup(pol->name);
+    if (pol->description)
+	res->policy_description = m_strdup(pol->description);
+
+    /* This should actually be caught in the xml-parsing. */
+    if (pol->nvers == 0) {
+	ds_printf(DS_LEV_ERR, "Failed, no Verification groups in policy.");
+	rc = DS_FAIL_NOPOLICIES;
+	goto out;
+    }
+
+    /* Now the final test */
+    ds_printf(DS_LEV_VER, "    Checking Verification group(s).");
+
+    for (g = 0; g < pol->nvers; g++) {
+	if (!verifyGroupRules(ctx, deb, originID, &pol->vers[g])) {
+	    ds_printf(DS_LEV_VER, "    Verification group failed checks.");
+	    ds_printf(DS_LEV_ERR, "Failed verification for %s.", deb->ar->name);
+	    rc = DS_FAIL_BADSIG;
+	    goto out;
+	}
+    }
+
+    ds_printf(DS_LEV_VER, "    Verification group(s) passed, deb is validated.");
+
+    ds_printf(DS_LEV_INFO, "Verified package from '%s' (%s)",
+	      pol->description, pol->name);
+
+out:
+    free(pol_file);
+
+    return rc;
+}
@@ -29,6 +29,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <obstack.h>
 
@@ -40,161 +44,258 @@
 #define obstack_chunk_alloc m_malloc
 #define obstack_chunk_free free
 
-static int parse_err_cnt;
-static struct policy ret;
-static struct group *cur_grp = NULL;
-static XML_Parser parser;
-static struct obstack deb_obs;
-static int deb_obs_init = 0;
+/* The state of a policy file being parsed, so that several can be parsed
+ * at the same time. */
+struct policy_parser {
+    XML_Parser parser;
+    struct policy *pol;
+    /* The Selection and Verification groups, and the matches of the
+     * current group, until they get copied as arrays into the policy. */
+    struct group *grps[2];
+    int ngrps[2];
+    int grps_alloc[2];
+    struct group *cur_grp;
+    struct match *matches;
+    int nmatches;
+    int matches_alloc;
+    int depth;
+    int err_cnt;
+    /* Where the attribute values get interned. */
+    struct ds_strtab *strings;
+    /* Whether to stop at the first Verification block, and whether it
+     * happened. */
+    bool selection_only;
+    bool stopped;
+};
+
+#define GROUP_SELECTION 0
+#define GROUP_VERIFICATION 1
 
 #define parse_error(fmt, args...) \
 { \
-    parse_err_cnt++; \
-    ds_printf(DS_LEV_DEBUG , "%lu: " fmt , XML_GetCurrentLineNumber(parser) , ## args); \
+    pp->err_cnt++; \
+    ds_printf(DS_LEV_DEBUG , "%lu: " fmt , XML_GetCurrentLineNumber(pp->parser) , ## args); \
+}
+
+/* The element and attribute names of the policy format. */
+enum policy_token {
+    TOK_UNKNOWN,
+    TOK_POLICY,
+    TOK_ORIGIN,
+    TOK_SELECTION,
+    TOK_VERIFICATION,
+    TOK_REQUIRED,
+    TOK_OPTIONAL,
+    TOK_REJECT,
+    TOK_XMLNS,
+    TOK_ID,
+    TOK_NAME,
+    TOK_DESCRIPTION,
+    TOK_MIN_OPTIONAL,
+    TOK_TYPE,
+    TOK_FILE,
+    TOK_EXPIRY,
+};
+
+struct policy_name {
+    const char *name;
+    enum policy_token token;
+};
+
+/* Perfect hash of the names above, with no collisions in 32 slots. Any
+ * change to the names needs the hash or the table size adjusted. */
+#define POLICY_NAME_HASH(name, len) \
+    (((len) * 4 + (unsigned char)(name)[0] + \
+      ((unsigned char)(name)[(len) - 1] << 3)) & 31)
+
+static const struct policy_name policy_names[32] = {
+    [0] = { "Description", TOK_DESCRIPTION },
+    [4] = { "xmlns", TOK_XMLNS },
+    [5] = { "Expiry", TOK_EXPIRY },
+    [6] = { "Name", TOK_NAME },
+    [7] = { "Selection", TOK_SELECTION },
+    [10] = { "Reject", TOK_REJECT },
+    [12] = { "Type", TOK_TYPE },
+    [15] = { "Optional", TOK_OPTIONAL },
+    [16] = { "Policy", TOK_POLICY },
+    [17] = { "id", TOK_ID },
+    [18] = { "Required", TOK_REQUIRED },
+    [22] = { "Verification", TOK_VERIFICATION },
+    [23] = { "Origin", TOK_ORIGIN },
+    [25] = { "MinOptional", TOK_MIN_OPTIONAL },
+    [30] = { "File", TOK_FILE },
+};
+
+static enum policy_token
+policy_token(const char *name)
+{
+    const struct policy_name *pn;
+    size_t len = strlen(name);
+
+    if (len == 0)
+	return TOK_UNKNOWN;
+
+    pn = &policy_names[POLICY_NAME_HASH(name, len)];
+    if (pn->name == NULL || strcmp(pn->name, name) != 0)
+	return TOK_UNKNOWN;
+
+    return pn->token;
+}
+
+static bool
+parse_number(const char *c)
+{
+    int t;
+
+    for (t = 0; c[t]; t++)
+	if (!isdigit(c[t]))
+	    return false;
+
+    return true;
 }
 
 static void
 startElement(void *userData, const char *name, const char **atts)
 {
+    struct policy_parser *pp = userData;
+    struct policy *ret = pp->pol;
+    enum policy_token tok = policy_token(name);
     int i, depth;
-    int *depthPtr = userData;
 
-    /* save the current and increment the userdata */
-    depth = *depthPtr;
-    *depthPtr = depth + 1;
+    /* save the current and increment the depth */
+    depth = pp->depth++;
 
-    if (strcmp(name, "Policy") == 0) {
+    switch (tok) {
+    case TOK_POLICY:
 	if (depth != 0)
 	    parse_error("policy parse error: 'Policy' found at wrong level");
 
 	for (i = 0; atts[i]; i += 2) {
-	    if (strcmp(atts[i], "xmlns") == 0) {
+	    if (policy_token(atts[i]) == TOK_XMLNS) {
 		if (strcmp(atts[i + 1], DEBSIG_NAMESPACE) != 0)
 		    parse_error("policy name space != " DEBSIG_NAMESPACE);
 	    } else
 		parse_error("Policy element contains unknown attribute '%s'",
 			     atts[i]);
 	}
-    } else if (strcmp(name, "Origin") == 0) {
+	break;
+    case TOK_ORIGIN:
 	if (depth != 1)
 	    parse_error("policy parse error: 'Origin' found at wrong level");
-	
+
 	for (i = 0; atts[i]; i += 2) {
-	    if (strcmp(atts[i], "id") == 0)
-		ret.id = obstack_copy0(&deb_obs, atts[i + 1], strlen(atts[i + 1]));
-	    else if (strcmp(atts[i], "Name") == 0)
-		ret.name = obstack_copy0(&deb_obs, atts[i + 1], strlen(atts[i + 1]));
-	    else if (strcmp(atts[i], "Description") == 0)
-		ret.description = obstack_copy0(&deb_obs, atts[i + 1], strlen(atts[i + 1]));
-	    else
+	    switch (policy_token(atts[i])) {
+	    case TOK_ID:
+		ret->id = ds_strtab_intern(pp->strings, atts[i + 1]);
+		break;
+	    case TOK_NAME:
+		ret->name = ds_strtab_intern(pp->strings, atts[i + 1]);
+		break;
+	    case TOK_DESCRIPTION:
+		ret->description = ds_strtab_intern(pp->strings, atts[i + 1]);
+		break;
+	    default:
 		parse_error("Origin element contains unknown attribute '%s'",
 			     atts[i]);
+	    }
 	}
 
-	if (ret.id == NULL || ret.name == NULL)
+	if (ret->id == NULL || ret->name == NULL)
 	    parse_error("Origin element missing Name or ID attribute");
-    } else if (strcmp(name, "Selection") == 0 ||
-	       strcmp(name, "Verification") == 0) {
-	struct group *g = NULL;
+	break;
+    case TOK_VERIFICATION:
+	if (pp->selection_only && depth == 1) {
+	    /* The policy file is expected to have its Selection blocks
+	     * first, and nothing else is needed to screen the policy. */
+	    ret->partial = true;
+	    pp->stopped = true;
+	    XML_StopParser(pp->parser, XML_FALSE);
+	    break;
+	}
+	/* Fall through. */
+    case TOK_SELECTION: {
+	int kind;
 
 	if (depth != 1)
 	    parse_error("policy parse error: 'Selection/Verification' found at wrong level");
 
 	/* create a new entry, make it the current */
-	cur_grp = (struct group *)obstack_alloc(&deb_obs, sizeof(struct group));
-	if (cur_grp == NULL)
-	    ohshit("out of memory");
-	memset(cur_grp, 0, sizeof(struct group));
-
-	if (strcmp(name, "Selection") == 0) {
-	    if (ret.sels == NULL)
-		ret.sels = cur_grp;
-	    else
-		g = ret.sels;
-	} else {
-	    if (ret.vers == NULL)
-		ret.vers = cur_grp;
-	    else
-		g = ret.vers;
-	}
-	if (g) {
-	    for ( ; g->next; g = g->next)
-		; /* find the end of the chain */
-	    g->next = cur_grp;
+	if (tok == TOK_SELECTION)
+	    kind = GROUP_SELECTION;
+	else
+	    kind = GROUP_VERIFICATION;
+	if (pp->ngrps[kind] == pp->grps_alloc[kind]) {
+	    pp->grps_alloc[kind] = pp->grps_alloc[kind] ? pp->grps_alloc[kind] * 2 : 4;
+	    pp->grps[kind] = m_realloc(pp->grps[kind],
+	                               pp->grps_alloc[kind] * sizeof(struct group));
 	}
+	pp->cur_grp = &pp->grps[kind][pp->ngrps[kind]++];
+	memset(pp->cur_grp, 0, sizeof(struct group));
+	pp->nmatches = 0;
 
 	for (i = 0; atts[i]; i += 2) {
-	    if (strcmp(atts[i], "MinOptional") == 0) {
-		int t;
-		const char *c = atts[i + 1];
-
-		for (t = 0; c[t]; t++) {
-		    if (!isdigit(c[t]))
-			parse_error("MinOptional requires a numerical value");
-		}
-		cur_grp->min_opt = atoi(c);
+	    if (policy_token(atts[i]) == TOK_MIN_OPTIONAL) {
+		if (!parse_number(atts[i + 1]))
+		    parse_error("MinOptional requires a numerical value");
+		pp->cur_grp->min_opt = atoi(atts[i + 1]);
 	    } else {
 		parse_error("Selection/Verification element contains unknown attribute '%s'",
 			     atts[i]);
 	    }
 	}
-    } else if (strcmp(name, "Required") == 0 ||
-	       strcmp(name, "Reject") == 0||
-	       strcmp(name, "Optional") == 0) {
-	struct match *m = NULL, *cur_m = NULL;
+	break;
+    }
+    case TOK_REQUIRED:
+    case TOK_OPTIONAL:
+    case TOK_REJECT: {
+	struct match *cur_m;
 
 	if (depth != 2)
 	    parse_error("policy parse error: Match element found at wrong level");
 
 	/* This should never happen with the other checks in place */
-	if (cur_grp == NULL) {
+	if (pp->cur_grp == NULL) {
 	    parse_error("policy parse error: No current group for match element");
 	    return;
 	}
 
-        /* create a new entry, make it the current */
-        cur_m = (struct match *)obstack_alloc(&deb_obs, sizeof(struct match));
-        if (cur_m == NULL)
-            ohshit("out of memory");
-        memset(cur_m, 0, sizeof(struct match));
-
-	if (cur_grp->matches == NULL)
-	    cur_grp->matches = cur_m;
-	else {
-	    for (m = cur_grp->matches; m->next; m = m->next)
-		; /* find the end of the chain */
-	    m->next = cur_m;
+	/* create a new entry, make it the current */
+	if (pp->nmatches == pp->matches_alloc) {
+	    pp->matches_alloc = pp->matches_alloc ? pp->matches_alloc * 2 : 8;
+	    pp->matches = m_realloc(pp->matches,
+	                            pp->matches_alloc * sizeof(struct match));
 	}
+	cur_m = &pp->matches[pp->nmatches++];
+	memset(cur_m, 0, sizeof(struct match));
 
 	/* Set the attributes first, so we can sanity check the type after */
-        for (i = 0; atts[i]; i += 2) {
-            if (strcmp(atts[i], "Type") == 0) {
-                cur_m->name = obstack_copy0(&deb_obs, atts[i + 1], strlen(atts[i + 1]));
-	    } else if (strcmp(atts[i], "File") == 0) {
-		cur_m->file = obstack_copy0(&deb_obs, atts[i + 1], strlen(atts[i + 1]));;
-	    } else if (strcmp(atts[i], "id") == 0) {
-		cur_m->id = obstack_copy0(&deb_obs, atts[i + 1], strlen(atts[i + 1]));;
-	    } else if (strcmp(atts[i], "Expiry") == 0) {
-		int t;
-		const char *c = atts[i + 1];
-
-		for (t = 0; c[t]; t++) {
-		    if (!isdigit(c[t]))
-			parse_error("Expiry requires a numerical value");
-		}
-                cur_m->day_expiry = atoi(c);
-            } else {
-                parse_error("Match element contains unknown attribute '%s'",
-                             atts[i]);
-            }
-        }
-
-
-        if (strcmp(name, "Required") == 0) {
+	for (i = 0; atts[i]; i += 2) {
+	    switch (policy_token(atts[i])) {
+	    case TOK_TYPE:
+		cur_m->name = ds_strtab_intern(pp->strings, atts[i + 1]);
+		break;
+	    case TOK_FILE:
+		cur_m->file = ds_strtab_intern(pp->strings, atts[i + 1]);
+		break;
+	    case TOK_ID:
+		cur_m->id = ds_strtab_intern(pp->strings, atts[i + 1]);
+		break;
+	    case TOK_EXPIRY:
+		if (!parse_number(atts[i + 1]))
+		    parse_error("Expiry requires a numerical value");
+		cur_m->day_expiry = atoi(atts[i + 1]);
+		break;
+	    default:
+		parse_error("Match element contains unknown attribute '%s'",
+			     atts[i]);
+	    }
+	}
+
+	if (tok == TOK_REQUIRED) {
 	    cur_m->type = REQUIRED_MATCH;
 	    if (cur_m->name == NULL || cur_m->file == NULL)
 		parse_error("Required must have a Type and File attribute");
-	} else if (strcmp(name, "Optional") == 0) {
+	} else if (tok == TOK_OPTIONAL) {
 	    cur_m->type = OPTIONAL_MATCH;
 	    if (cur_m->name == NULL || cur_m->file == NULL)
 		parse_error("Optional must have a Type and File attribute");
@@ -203,106 +304,158 @@ startElement(void *userData, const char *name, const char **atts)
 	    if (cur_m->name == NULL)
 		parse_error("Reject must have a Type attribute");
 	}
+	break;
+    }
+    default:
+	break;
     }
 }
 
 static void
 endElement(void *userData, const char *name)
 {
-    int *depthPtr = userData;
-    *depthPtr -= 1;
+    struct policy_parser *pp = userData;
+    enum policy_token tok = policy_token(name);
+
+    pp->depth--;
+
+    if (tok == TOK_SELECTION || tok == TOK_VERIFICATION) {
+	struct obstack *obs = &pp->pol->obs;
+	int i, n = 0;
 
-    if (strcmp(name, "Selection") == 0 || strcmp(name, "Verification") == 0) {
-	struct match *m;
-	int i = 0;
+	if (pp->cur_grp == NULL)
+	    return;
 
 	/* sanity check this block */
-	for (m = cur_grp->matches; m; m = m->next) {
-	    if (m->type == OPTIONAL_MATCH ||
-		m->type == REQUIRED_MATCH)
-		i++;
+	for (i = 0; i < pp->nmatches; i++) {
+	    if (pp->matches[i].type == OPTIONAL_MATCH ||
+		pp->matches[i].type == REQUIRED_MATCH)
+		n++;
 	}
-	if (!i) {
+	if (!n) {
 	    parse_error("Selection/Verification block does not contain any "
 			 "Required or Optional matches.");
 	}
-	cur_grp = NULL; /* just to make sure */
+
+	if (pp->nmatches)
+	    pp->cur_grp->matches = obstack_copy(obs, pp->matches,
+	                                        pp->nmatches * sizeof(struct match));
+	pp->cur_grp->nmatches = pp->nmatches;
+	pp->nmatches = 0;
+	pp->cur_grp = NULL; /* just to make sure */
     }
 }
 
+/* Move the groups parsed into the policy arena. */
+static struct group *
+policy_groups(struct policy_parser *pp, int kind, int *ngrps)
+{
+    *ngrps = pp->ngrps[kind];
+    if (pp->ngrps[kind] == 0)
+	return NULL;
+
+    return obstack_copy(&pp->pol->obs, pp->grps[kind],
+                        pp->ngrps[kind] * sizeof(struct group));
+}
+
 void
-clear_policy(void)
+policy_free(struct policy *pol)
 {
-    if (deb_obs_init) {
-	obstack_free(&deb_obs, 0);
-	deb_obs_init = 0;
-    }
-    memset(&ret, '\0', sizeof(struct policy));
+    if (pol == NULL)
+	return;
+
+    obstack_free(&pol->obs, NULL);
+    free(pol);
 }
 
+/* Parse a policy file into a newly allocated policy, which the caller
+ * owns and releases with policy_free(). The parser keeps no state outside
+ * the policy being built, so any number of policies can be parsed and kept
+ * around at the same time. The attribute values get interned in strings,
+ * which must outlive the policy. With selection_only, parsing stops at the
+ * first Verification block, and the policy is marked as partial. */
 struct policy *
-parsePolicyFile(const char *filename)
+parsePolicyFile(const char *filename, struct ds_strtab *strings,
+                bool selection_only)
 {
-    char buf[BUFSIZ];
-    int done, depth = 0;
-    FILE *pol_fs;
+    struct policy_parser pp;
     struct stat st;
-
-    /* clear and initialize */
-    parser = XML_ParserCreate(NULL);
-    //clear_policy();
-    obstack_init(&deb_obs);
-    deb_obs_init = 1;
+    void *map = NULL;
+    int fd;
 
     ds_printf(DS_LEV_DEBUG, "    parsePolicyFile: parsing '%s'", filename);
 
-    pol_fs = fopen(filename, "r");
-    if (pol_fs == NULL) {
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
 	ds_printf(DS_LEV_ERR, "parsePolicyFile: could not open '%s' (%s)",
 		  filename, strerror(errno));
 	return NULL;
     }
-    if (fstat(fileno(pol_fs), &st)) {
+    if (fstat(fd, &st)) {
 	ds_printf(DS_LEV_ERR, "parsePolicyFile: could not stat %s", filename);
-	fclose(pol_fs);
+	close(fd);
 	return NULL;
     }
     if (!S_ISREG(st.st_mode)) {
 	ds_printf(DS_LEV_ERR, "parsePolicyFile: %s is not a regular file", filename);
-	fclose(pol_fs);
+	close(fd);
 	return NULL;
     }
-
-    XML_SetUserData(parser, &depth);
-    XML_SetElementHandler(parser, startElement, endElement);
-
-    parse_err_cnt = 0;
-
-    do {
-	size_t len = fread(buf, 1, sizeof(buf), pol_fs);
-
-	done = len < sizeof(buf);
-	if (!XML_Parse(parser, buf, len, done)) {
-	    ds_printf(DS_LEV_DEBUG,
-		"%s at line %lu",
-		XML_ErrorString(XML_GetErrorCode(parser)),
-		XML_GetCurrentLineNumber(parser));
-	    parse_err_cnt++;
-	    break;
+    if (st.st_size > INT_MAX) {
+	ds_printf(DS_LEV_ERR, "parsePolicyFile: %s is too large", filename);
+	close(fd);
+	return NULL;
+    }
+    /* Hand the whole file to the parser in one go. */
+    if (st.st_size > 0) {
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+	    ds_printf(DS_LEV_ERR, "parsePolicyFile: could not map %s (%s)",
+		      filename, strerror(errno));
+	    close(fd);
+	    return NULL;
 	}
-    } while (!done);
+    }
+    close(fd);
+
+    /* initialize */
+    memset(&pp, 0, sizeof(pp));
+    pp.strings = strings;
+    pp.selection_only = selection_only;
+    pp.pol = m_malloc(sizeof(*pp.pol));
+    memset(pp.pol, 0, sizeof(*pp.pol));
+    obstack_init(&pp.pol->obs);
+    pp.parser = XML_ParserCreate(NULL);
+
+    XML_SetUserData(pp.parser, &pp);
+    XML_SetElementHandler(pp.parser, startElement, endElement);
+
+    if (!XML_Parse(pp.parser, map ? map : "", st.st_size, 1) && !pp.stopped) {
+	ds_printf(DS_LEV_DEBUG,
+	    "%s at line %lu",
+	    XML_ErrorString(XML_GetErrorCode(pp.parser)),
+	    XML_GetCurrentLineNumber(pp.parser));
+	pp.err_cnt++;
+    }
+
+    XML_ParserFree(pp.parser);
+    if (map)
+	munmap(map, st.st_size);
 
-    XML_ParserFree(parser);
-    fclose(pol_fs);
+    pp.pol->sels = policy_groups(&pp, GROUP_SELECTION, &pp.pol->nsels);
+    pp.pol->vers = policy_groups(&pp, GROUP_VERIFICATION, &pp.pol->nvers);
+    free(pp.grps[GROUP_SELECTION]);
+    free(pp.grps[GROUP_VERIFICATION]);
+    free(pp.matches);
 
     ds_printf(DS_LEV_DEBUG, "    parsePolicyFile: completed");
 
-    if (parse_err_cnt) {
+    if (pp.err_cnt) {
 	ds_printf(DS_LEV_DEBUG, "    parsePolicyFile: %d errors during parsing, failed",
-		  parse_err_cnt);
-	clear_policy();
+		  pp.err_cnt);
+	policy_free(pp.pol);
 	return NULL;
     }
 
-    return &ret;
+    return pp.pol;
 }
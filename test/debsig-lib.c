@@ -0,0 +1,134 @@
+/*
+ * debsig-lib - exercise the libdebsig API
+ *
+ * Copyright © 2026 Guillem Jover <guillem@debian.org>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libdebsig.h"
+
+static void
+print_result(const char *how, const char *filename,
+             const struct debsig_result *res)
+{
+    printf("%s %s: %d origin=%s policy=%s error=%s\n", how, filename,
+           res->status,
+           res->origin ? res->origin : "-",
+           res->policy_name ? res->policy_name : "-",
+           res->error ? "yes" : "no");
+}
+
+/* What the library must leave alone in the program it runs in. */
+struct host_state {
+    const char *gnupghome;
+    struct sigaction sigpipe;
+    sigset_t mask;
+    mode_t umask;
+};
+
+static void
+host_state_get(struct host_state *hs)
+{
+    hs->gnupghome = getenv("GNUPGHOME");
+    sigaction(SIGPIPE, NULL, &hs->sigpipe);
+    sigprocmask(SIG_SETMASK, NULL, &hs->mask);
+    hs->umask = umask(0);
+    umask(hs->umask);
+}
+
+static int
+host_state_same(const struct host_state *a, const struct host_state *b)
+{
+    return a->gnupghome == b->gnupghome &&
+           a->sigpipe.sa_handler == b->sigpipe.sa_handler &&
+           sigismember(&a->mask, SIGPIPE) == sigismember(&b->mask, SIGPIPE) &&
+           a->umask == b->umask;
+}
+
+/* Verify each package twice with the same context, by name and from a
+ * file descriptor, which must be left open. The backend can be picked
+ * with DEBSIG_TEST_BACKEND. */
+int
+main(int argc, char *argv[])
+{
+    struct debsig_ctx *ctx;
+    struct debsig_result res;
+    struct host_state before, after;
+    const char *backend;
+    int i, fd, status = 0;
+
+    if (argc < 3) {
+	fprintf(stderr, "usage: %s <policies-dir> <keyrings-dir> <deb>...\n",
+	        argv[0]);
+	return 1;
+    }
+
+    ctx = debsig_ctx_new();
+    if (ctx == NULL ||
+        debsig_ctx_set_policies_dir(ctx, argv[1]) < 0 ||
+        debsig_ctx_set_keyrings_dir(ctx, argv[2]) < 0) {
+	perror("cannot set up context");
+	return 1;
+    }
+    backend = getenv("DEBSIG_TEST_BACKEND");
+    if (backend && strcmp(backend, "gpg") == 0)
+	debsig_ctx_set_backend(ctx, DEBSIG_BACKEND_GPG);
+
+    host_state_get(&before);
+
+    for (i = 3; i < argc; i++) {
+	debsig_verify_file(ctx, argv[i], NULL, &res);
+	print_result("file", argv[i], &res);
+	if (res.status != DEBSIG_OK)
+	    status = 1;
+	debsig_result_destroy(&res);
+
+	fd = open(argv[i], O_RDONLY);
+	if (fd < 0) {
+	    perror(argv[i]);
+	    status = 1;
+	    continue;
+	}
+	debsig_verify_fd(ctx, fd, argv[i], NULL, &res);
+	print_result("fd", argv[i], &res);
+	debsig_result_destroy(&res);
+	if (close(fd) < 0) {
+	    perror("descriptor not left open");
+	    status = 1;
+	}
+    }
+
+    debsig_ctx_free(ctx);
+
+    host_state_get(&after);
+    if (!host_state_same(&before, &after)) {
+	fprintf(stderr, "library changed the process state\n");
+	status = 1;
+    }
+
+    return status;
+}